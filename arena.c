@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arena.h>
+
+#define ARENA_ALIGN 16
+
+bool
+arena_init(struct arena *a, size_t size)
+{
+    a->base = malloc(size);
+    if (!a->base)
+        return false;
+    a->size = size;
+    a->used = 0;
+
+    return true;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+    free(a->base);
+    a->base = NULL;
+    a->size = 0;
+    a->used = 0;
+}
+
+/* Returns NULL if the arena does not have len bytes left. */
+void *
+arena_alloc(struct arena *a, size_t len)
+{
+    size_t start = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (start > a->size || len > a->size - start)
+        return NULL;
+    a->used = start + len;
+
+    return a->base + start;
+}
+
+void *
+arena_memdup(struct arena *a, const void *src, size_t len)
+{
+    void *p = arena_alloc(a, len);
+
+    if (p)
+        memcpy(p, src, len);
+
+    return p;
+}
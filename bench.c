@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the hot paths of the variable store and the
+ * authenticated variable code. Run with "make bench", optionally passing the
+ * names of the benchmarks to run.
+ */
+
+/* Including this directly allows us to time static functions. */
+#include "handler.c"
+#include "mor.c"
+
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/pkcs7.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+
+const enum log_level log_level = LOG_LVL_ERROR;
+
+static bool
+null_set_variable(void)
+{
+    return true;
+}
+
+static const struct backend benchdb = {
+    .set_variable = null_set_variable,
+};
+const struct backend *db = &benchdb;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+report(const char *name, size_t n, uint64_t ops, uint64_t ns)
+{
+    printf("%-24s n=%-7zu %10.1f ns/op\n", name, n, (double)ns / ops);
+}
+
+/* Fills the store with n variables spread over a few GUIDs. */
+static void
+fill_store(size_t n, uint8_t (*names)[32], UINTN *name_lens, EFI_GUID *guids)
+{
+    struct efi_variable *l;
+    uint8_t data[16] = {0};
+    size_t i;
+
+    varstore_clear();
+    for (i = 0; i < n; i++) {
+        char str[16];
+        int j, len;
+
+        len = snprintf(str, sizeof(str), "Boot%04zx", i);
+        for (j = 0; j <= len; j++) {
+            names[i][j * 2] = j < len ? str[j] : 0;
+            names[i][j * 2 + 1] = 0;
+        }
+        name_lens[i] = (len + 1) * 2;
+        memset(&guids[i], 0, sizeof(guids[i]));
+        guids[i].data[0] = i % 4;
+
+        l = varstore_new(names[i], name_lens[i], &guids[i], data, sizeof(data));
+        if (!l || !varstore_insert(l))
+            abort();
+        l->attributes = ATTR_BRNV;
+    }
+}
+
+static void
+bench_lookup(void)
+{
+    static const size_t sizes[] = {64, 256, MAX_VARIABLE_COUNT};
+    uint8_t (*names)[32];
+    UINTN *name_lens;
+    EFI_GUID *guids, miss;
+    size_t s, n, i, found;
+    uint64_t start, ops;
+
+    for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+        n = sizes[s];
+        names = malloc(n * sizeof(*names));
+        name_lens = malloc(n * sizeof(*name_lens));
+        guids = malloc(n * sizeof(*guids));
+        if (!names || !name_lens || !guids)
+            abort();
+        fill_store(n, names, name_lens, guids);
+
+        ops = 4000000;
+        found = 0;
+        start = now_ns();
+        for (i = 0; i < ops; i++) {
+            size_t k = (i * 2654435761u) % n;
+
+            found += !!varstore_lookup(names[k], name_lens[k], &guids[k]);
+        }
+        report("lookup/hit", n, ops, now_ns() - start);
+        if (found != ops)
+            abort();
+
+        start = now_ns();
+        for (i = 0; i < ops; i++) {
+            size_t k = (i * 2654435761u) % n;
+
+            miss = guids[k];
+            miss.data[15] = 0xff;
+            found += !!varstore_lookup(names[k], name_lens[k], &miss);
+        }
+        report("lookup/miss", n, ops, now_ns() - start);
+
+        varstore_clear();
+        free(names);
+        free(name_lens);
+        free(guids);
+    }
+}
+
+/* A full GetVariable command, including parsing and the response. */
+static void
+bench_get_variable(void)
+{
+    static uint8_t buf[SHMEM_SIZE];
+    uint8_t names[64][32], *ptr;
+    UINTN name_lens[64];
+    EFI_GUID guids[64];
+    size_t i, n = ARRAY_SIZE(names);
+    uint64_t start, ops = 1000000;
+
+    fill_store(n, names, name_lens, guids);
+
+    start = now_ns();
+    for (i = 0; i < ops; i++) {
+        size_t k = i % n;
+
+        ptr = buf;
+        serialize_uint32(&ptr, 1);
+        serialize_uint32(&ptr, COMMAND_GET_VARIABLE);
+        serialize_data(&ptr, names[k], name_lens[k]);
+        serialize_guid(&ptr, &guids[k]);
+        serialize_uintn(&ptr, 64);
+        *ptr = 0;
+        dispatch_command(buf);
+
+        ptr = buf;
+        if (unserialize_uintn(&ptr) != EFI_SUCCESS)
+            abort();
+    }
+    report("get_variable", n, ops, now_ns() - start);
+
+    varstore_clear();
+}
+
+static void
+make_signer(const char *cn, EVP_PKEY **pkey, X509 **cert)
+{
+    EVP_PKEY_CTX *ctx;
+    X509_NAME *name;
+
+    *pkey = NULL;
+    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 ||
+            EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) <= 0 ||
+            EVP_PKEY_keygen(ctx, pkey) <= 0)
+        abort();
+    EVP_PKEY_CTX_free(ctx);
+
+    *cert = X509_new();
+    if (!*cert)
+        abort();
+    X509_set_version(*cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(*cert), 1);
+    X509_gmtime_adj(X509_get_notBefore(*cert), 0);
+    X509_gmtime_adj(X509_get_notAfter(*cert), 3600);
+    X509_set_pubkey(*cert, *pkey);
+    name = X509_get_subject_name(*cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *)cn, -1, -1, 0);
+    X509_set_issuer_name(*cert, name);
+    if (!X509_sign(*cert, *pkey, EVP_sha256()))
+        abort();
+}
+
+/* Returns a signature list holding just cert. */
+static uint8_t *
+cert_list(X509 *cert, UINTN *len)
+{
+    EFI_SIGNATURE_LIST *list;
+    EFI_SIGNATURE_DATA *entry;
+    uint8_t *ptr;
+    int cert_len = i2d_X509(cert, NULL);
+
+    *len = sizeof(*list) + EFI_SIG_DATA_SIZE + cert_len;
+    list = calloc(1, *len);
+    if (!list)
+        abort();
+    list->SignatureType = gEfiCertX509Guid;
+    list->SignatureListSize = *len;
+    list->SignatureSize = EFI_SIG_DATA_SIZE + cert_len;
+    entry = (EFI_SIGNATURE_DATA *)(list + 1);
+    ptr = entry->SignatureData;
+    i2d_X509(cert, &ptr);
+
+    return (uint8_t *)list;
+}
+
+/* Returns an authentication descriptor followed by data, signed by cert. */
+static uint8_t *
+sign_update(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+            UINT32 attr, const EFI_TIME *timestamp,
+            const uint8_t *data, UINTN data_len,
+            X509 *cert, EVP_PKEY *pkey, UINTN *len)
+{
+    const int flags = PKCS7_BINARY | PKCS7_DETACHED | PKCS7_NOATTR;
+    EFI_VARIABLE_AUTHENTICATION_2 *d;
+    uint8_t *request, *ptr, *out;
+    UINTN request_len, hdr_len;
+    PKCS7 *p7;
+    BIO *bio;
+    int sig_len;
+
+    request_len = name_len + GUID_LEN + sizeof(attr) + sizeof(*timestamp) +
+                  data_len;
+    ptr = request = malloc(request_len);
+    if (!request)
+        abort();
+    memcpy(ptr, name, name_len);
+    ptr += name_len;
+    memcpy(ptr, guid, GUID_LEN);
+    ptr += GUID_LEN;
+    memcpy(ptr, &attr, sizeof(attr));
+    ptr += sizeof(attr);
+    memcpy(ptr, timestamp, sizeof(*timestamp));
+    ptr += sizeof(*timestamp);
+    memcpy(ptr, data, data_len);
+
+    bio = BIO_new_mem_buf(request, request_len);
+    p7 = PKCS7_sign(NULL, NULL, NULL, bio, flags | PKCS7_PARTIAL);
+    if (!p7 || !PKCS7_sign_add_signer(p7, cert, pkey, EVP_sha256(), flags) ||
+            !PKCS7_final(p7, bio, flags))
+        abort();
+    BIO_free(bio);
+    free(request);
+
+    sig_len = i2d_PKCS7(p7, NULL);
+    hdr_len = offsetof(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo.CertData) +
+              sig_len;
+    *len = hdr_len + data_len;
+    out = calloc(1, *len);
+    if (!out)
+        abort();
+
+    d = (EFI_VARIABLE_AUTHENTICATION_2 *)out;
+    d->TimeStamp = *timestamp;
+    d->AuthInfo.CertType = gEfiCertPkcs7Guid;
+    d->AuthInfo.Hdr.dwLength = offsetof(WIN_CERTIFICATE_UEFI_GUID, CertData) +
+                               sig_len;
+    d->AuthInfo.Hdr.wRevision = 0x0200;
+    d->AuthInfo.Hdr.wCertificateType = WIN_CERT_TYPE_EFI_GUID;
+    ptr = d->AuthInfo.CertData;
+    i2d_PKCS7(p7, &ptr);
+    PKCS7_free(p7);
+    memcpy(out + hdr_len, data, data_len);
+
+    return out;
+}
+
+static EFI_STATUS
+set_signed(uint8_t *buf, const uint8_t *name, UINTN name_len,
+           const EFI_GUID *guid, UINT32 attr,
+           const uint8_t *auth, UINTN auth_len)
+{
+    uint8_t *ptr = buf;
+
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, COMMAND_SET_VARIABLE);
+    serialize_data(&ptr, name, name_len);
+    serialize_guid(&ptr, guid);
+    serialize_data(&ptr, auth, auth_len);
+    serialize_uint32(&ptr, attr);
+    *ptr = 0;
+    dispatch_command(buf);
+
+    ptr = buf;
+    return unserialize_uintn(&ptr);
+}
+
+/*
+ * Resets the store and moves into user mode with a freshly generated PK and
+ * a KEK signed by it.
+ */
+static void
+enrol_keys(uint8_t *buf, EVP_PKEY **pk_key, X509 **pk_cert,
+           EVP_PKEY **kek_key, X509 **kek_cert, const EFI_TIME *ts)
+{
+    uint8_t *list, *auth;
+    UINTN list_len, auth_len;
+
+    make_signer("PK", pk_key, pk_cert);
+    make_signer("KEK", kek_key, kek_cert);
+
+    varstore_clear();
+    if (!setup_variables())
+        abort();
+
+    list = cert_list(*pk_cert, &list_len);
+    auth = sign_update(EFI_PLATFORM_KEY_NAME, sizeof(EFI_PLATFORM_KEY_NAME),
+                       &gEfiGlobalVariableGuid, ATTR_BRNV_TIME, ts,
+                       list, list_len, *pk_cert, *pk_key, &auth_len);
+    if (set_signed(buf, EFI_PLATFORM_KEY_NAME, sizeof(EFI_PLATFORM_KEY_NAME),
+                   &gEfiGlobalVariableGuid, ATTR_BRNV_TIME,
+                   auth, auth_len) != EFI_SUCCESS)
+        abort();
+    free(list);
+    free(auth);
+
+    list = cert_list(*kek_cert, &list_len);
+    auth = sign_update(EFI_KEY_EXCHANGE_KEY_NAME,
+                       sizeof(EFI_KEY_EXCHANGE_KEY_NAME),
+                       &gEfiGlobalVariableGuid, ATTR_BRNV_TIME, ts,
+                       list, list_len, *pk_cert, *pk_key, &auth_len);
+    if (set_signed(buf, EFI_KEY_EXCHANGE_KEY_NAME,
+                   sizeof(EFI_KEY_EXCHANGE_KEY_NAME),
+                   &gEfiGlobalVariableGuid, ATTR_BRNV_TIME,
+                   auth, auth_len) != EFI_SUCCESS)
+        abort();
+    free(list);
+    free(auth);
+}
+
+/*
+ * Appends to dbx in user mode with an update signed by a KEK, so the PK is
+ * tried first as it would be by firmware.
+ */
+static void
+bench_dbx_update(void)
+{
+    static uint8_t buf[SHMEM_SIZE];
+    EFI_TIME ts = {2024, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0};
+    EVP_PKEY *pk_key, *kek_key, *db_key;
+    X509 *pk_cert, *kek_cert, *db_cert;
+    uint8_t *list, *auth, **auths;
+    UINTN list_len, auth_len, *auth_lens;
+    uint64_t start;
+    size_t i, ops = 2000, fresh_ops = 200;
+
+    make_signer("dbx", &db_key, &db_cert);
+    enrol_keys(buf, &pk_key, &pk_cert, &kek_key, &kek_cert, &ts);
+
+    /*
+     * Appending an entry that is already there leaves dbx unchanged. The same
+     * update is replayed, as OS update agents do.
+     */
+    list = cert_list(db_cert, &list_len);
+    auth = sign_update(EFI_IMAGE_SECURITY_DATABASE1,
+                       sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                       &gEfiImageSecurityDatabaseGuid,
+                       ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &ts,
+                       list, list_len, kek_cert, kek_key, &auth_len);
+
+    start = now_ns();
+    for (i = 0; i < ops; i++) {
+        if (set_signed(buf, EFI_IMAGE_SECURITY_DATABASE1,
+                       sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                       &gEfiImageSecurityDatabaseGuid,
+                       ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE,
+                       auth, auth_len) != EFI_SUCCESS)
+            abort();
+    }
+    report("dbx_update", 1, ops, now_ns() - start);
+    free(auth);
+
+    /* Updates signed at different times, so each must be verified. */
+    auths = malloc(fresh_ops * sizeof(*auths));
+    auth_lens = malloc(fresh_ops * sizeof(*auth_lens));
+    if (!auths || !auth_lens)
+        abort();
+    for (i = 0; i < fresh_ops; i++) {
+        ts.Minute = 1 + i / 60;
+        ts.Second = i % 60;
+        auths[i] = sign_update(EFI_IMAGE_SECURITY_DATABASE1,
+                               sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                               &gEfiImageSecurityDatabaseGuid,
+                               ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &ts,
+                               list, list_len, kek_cert, kek_key,
+                               &auth_lens[i]);
+    }
+
+    start = now_ns();
+    for (i = 0; i < fresh_ops; i++) {
+        if (set_signed(buf, EFI_IMAGE_SECURITY_DATABASE1,
+                       sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                       &gEfiImageSecurityDatabaseGuid,
+                       ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE,
+                       auths[i], auth_lens[i]) != EFI_SUCCESS)
+            abort();
+    }
+    report("dbx_update_fresh", 1, fresh_ops, now_ns() - start);
+
+    for (i = 0; i < fresh_ops; i++)
+        free(auths[i]);
+    free(auths);
+    free(auth_lens);
+    free(list);
+    varstore_clear();
+    EVP_PKEY_free(pk_key);
+    EVP_PKEY_free(kek_key);
+    EVP_PKEY_free(db_key);
+    X509_free(pk_cert);
+    X509_free(kek_cert);
+    X509_free(db_cert);
+}
+
+/* Returns a signature list of the SHA-256 hashes of first to first + n - 1. */
+static uint8_t *
+hash_list(uint32_t first, uint32_t n, UINTN *len)
+{
+    EFI_SIGNATURE_LIST *list;
+    EFI_SIGNATURE_DATA *entry;
+    uint32_t i, v;
+
+    *len = sizeof(*list) + n * (EFI_SIG_DATA_SIZE + SHA256_DIGEST_SIZE);
+    list = calloc(1, *len);
+    if (!list)
+        abort();
+    list->SignatureType = mSupportSigItem[0].SigType; /* EFI_CERT_SHA256_GUID */
+    list->SignatureListSize = *len;
+    list->SignatureSize = EFI_SIG_DATA_SIZE + SHA256_DIGEST_SIZE;
+    entry = (EFI_SIGNATURE_DATA *)(list + 1);
+    for (i = 0; i < n; i++) {
+        v = first + i;
+        SHA256((uint8_t *)&v, sizeof(v), entry->SignatureData);
+        entry = (EFI_SIGNATURE_DATA *)((uint8_t *)entry + list->SignatureSize);
+    }
+
+    return (uint8_t *)list;
+}
+
+/*
+ * Appends revocations to a dbx holding n hashes. Half of the appended hashes
+ * are new the first time and the update is then replayed, so after that every
+ * entry is a duplicate to filter out.
+ */
+static void
+bench_dbx_append(void)
+{
+    static uint8_t buf[SHMEM_SIZE];
+    static const size_t sizes[] = {400, 1000};
+    EFI_TIME ts = {2024, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0};
+    const UINT32 attr = ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE;
+    const uint32_t append = 200;
+    EVP_PKEY *pk_key, *kek_key;
+    X509 *pk_cert, *kek_cert;
+    uint8_t *list, *auth;
+    UINTN list_len, auth_len;
+    uint64_t start;
+    size_t i, s, ops = 200;
+
+    for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+        enrol_keys(buf, &pk_key, &pk_cert, &kek_key, &kek_cert, &ts);
+
+        list = hash_list(0, sizes[s], &list_len);
+        auth = sign_update(EFI_IMAGE_SECURITY_DATABASE1,
+                           sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                           &gEfiImageSecurityDatabaseGuid, ATTR_BRNV_TIME,
+                           &ts, list, list_len, kek_cert, kek_key, &auth_len);
+        if (set_signed(buf, EFI_IMAGE_SECURITY_DATABASE1,
+                       sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                       &gEfiImageSecurityDatabaseGuid, ATTR_BRNV_TIME,
+                       auth, auth_len) != EFI_SUCCESS)
+            abort();
+        free(list);
+        free(auth);
+
+        list = hash_list(sizes[s] - append / 2, append, &list_len);
+        auth = sign_update(EFI_IMAGE_SECURITY_DATABASE1,
+                           sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                           &gEfiImageSecurityDatabaseGuid, attr,
+                           &ts, list, list_len, kek_cert, kek_key, &auth_len);
+
+        start = now_ns();
+        for (i = 0; i < ops; i++) {
+            if (set_signed(buf, EFI_IMAGE_SECURITY_DATABASE1,
+                           sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                           &gEfiImageSecurityDatabaseGuid, attr,
+                           auth, auth_len) != EFI_SUCCESS)
+                abort();
+        }
+        report("dbx_append", sizes[s], ops, now_ns() - start);
+
+        free(list);
+        free(auth);
+        varstore_clear();
+        EVP_PKEY_free(pk_key);
+        EVP_PKEY_free(kek_key);
+        X509_free(pk_cert);
+        X509_free(kek_cert);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} benches[] = {
+    {"lookup", bench_lookup},
+    {"get_variable", bench_get_variable},
+    {"dbx_update", bench_dbx_update},
+    {"dbx_append", bench_dbx_append},
+};
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int j;
+
+    for (i = 0; i < ARRAY_SIZE(benches); i++) {
+        if (argc > 1) {
+            for (j = 1; j < argc; j++) {
+                if (!strcmp(argv[j], benches[i].name))
+                    break;
+            }
+            if (j == argc)
+                continue;
+        }
+        benches[i].fn();
+    }
+
+    return 0;
+}
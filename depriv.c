@@ -105,9 +105,32 @@ static const int seccomp_blacklist[] = {
     SCMP_SYS(sched_get_priority_min),
 };
 
+/*
+ * With worker threads, clone() must be allowed for new threads but not for
+ * new processes. clone3() passes its flags in memory where seccomp cannot
+ * inspect them, so it is made to fail with ENOSYS and glibc falls back to
+ * clone().
+ */
+static int
+allow_threads(scmp_filter_ctx ctx)
+{
+    int rc;
+
+    rc = seccomp_rule_add(ctx, SCMP_ACT_KILL, SCMP_SYS(clone), 1,
+                          SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_THREAD, 0));
+    if (rc < 0)
+        return rc;
+
+    return seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(clone3), 0);
+}
+
+/*
+ * nr_threads is the number of threads the caller will create after dropping
+ * privileges.
+ */
 bool
 drop_privileges(const char *opt_chroot, bool opt_depriv, gid_t opt_gid,
-                uid_t opt_uid)
+                uid_t opt_uid, unsigned int nr_threads)
 {
     if (opt_chroot) {
         if (chroot(opt_chroot) < 0) {
@@ -160,9 +183,9 @@ drop_privileges(const char *opt_chroot, bool opt_depriv, gid_t opt_gid,
         limit.rlim_max = 256 * 1024;
         setrlimit(RLIMIT_FSIZE, &limit);
 
-        /* Set the maximum number of threads/processes to 1. */
-        limit.rlim_cur = 1;
-        limit.rlim_max = 1;
+        /* Limit the number of threads/processes to those expected. */
+        limit.rlim_cur = 1 + nr_threads;
+        limit.rlim_max = 1 + nr_threads;
         setrlimit(RLIMIT_NPROC, &limit);
 
         ctx = seccomp_init(SCMP_ACT_ALLOW);
@@ -172,6 +195,9 @@ drop_privileges(const char *opt_chroot, bool opt_depriv, gid_t opt_gid,
         }
 
         for (i = 0; i < ARRAY_SIZE(seccomp_blacklist); i++) {
+            if (nr_threads && seccomp_blacklist[i] == SCMP_SYS(clone))
+                continue;
+
             rc = seccomp_rule_add(ctx, SCMP_ACT_KILL, seccomp_blacklist[i], 0);
             if (rc < 0) {
                 ERR("seccomp_rule_add failed: %d, %s\n", -rc, strerror(-rc));
@@ -180,6 +206,15 @@ drop_privileges(const char *opt_chroot, bool opt_depriv, gid_t opt_gid,
             }
         }
 
+        if (nr_threads) {
+            rc = allow_threads(ctx);
+            if (rc < 0) {
+                ERR("seccomp_rule_add failed: %d, %s\n", -rc, strerror(-rc));
+                seccomp_release(ctx);
+                return false;
+            }
+        }
+
         rc = seccomp_load(ctx);
         seccomp_release(ctx);
         if (rc < 0) {
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <debug.h>
+#include <event.h>
+
+#define MAX_EVENTS 16
+
+struct event {
+    int fd;
+    bool timer;
+    bool removed;
+    event_fn fn;
+    void *opaque;
+    struct event *next;
+};
+
+static struct {
+    int epfd;
+    struct event *active;
+    struct event *removed; /* Freed once the current dispatch is done */
+} loop = { .epfd = -1 };
+
+bool
+event_init(void)
+{
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        ERR("Failed to create epoll instance: %d, %s\n",
+            errno, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void
+free_removed(void)
+{
+    struct event *ev;
+
+    while ((ev = loop.removed)) {
+        loop.removed = ev->next;
+        free(ev);
+    }
+}
+
+void
+event_destroy(void)
+{
+    while (loop.active)
+        event_remove(loop.active);
+    free_removed();
+    if (loop.epfd >= 0)
+        close(loop.epfd);
+    loop.epfd = -1;
+}
+
+static struct event *
+add_event(int fd, bool timer, event_fn fn, void *opaque)
+{
+    struct epoll_event e;
+    struct event *ev;
+
+    ev = calloc(1, sizeof(*ev));
+    if (!ev)
+        return NULL;
+
+    ev->fd = fd;
+    ev->timer = timer;
+    ev->fn = fn;
+    ev->opaque = opaque;
+
+    e.events = EPOLLIN;
+    e.data.ptr = ev;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &e) < 0) {
+        ERR("Failed to add fd to epoll: %d, %s\n", errno, strerror(errno));
+        free(ev);
+        return NULL;
+    }
+
+    ev->next = loop.active;
+    loop.active = ev;
+
+    return ev;
+}
+
+struct event *
+event_add_fd(int fd, event_fn fn, void *opaque)
+{
+    return add_event(fd, false, fn, opaque);
+}
+
+struct event *
+event_add_timer(unsigned int ms, bool periodic, event_fn fn, void *opaque)
+{
+    struct event *ev;
+    int fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        ERR("Failed to create timer: %d, %s\n", errno, strerror(errno));
+        return NULL;
+    }
+
+    ev = add_event(fd, true, fn, opaque);
+    if (!ev) {
+        close(fd);
+        return NULL;
+    }
+
+    if (!event_set_timer(ev, ms, periodic)) {
+        event_remove(ev);
+        return NULL;
+    }
+
+    return ev;
+}
+
+bool
+event_set_timer(struct event *ev, unsigned int ms, bool periodic)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    if (periodic)
+        its.it_interval = its.it_value;
+
+    if (timerfd_settime(ev->fd, 0, &its, NULL) < 0) {
+        ERR("Failed to set timer: %d, %s\n", errno, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * The event may still be referenced by the batch being dispatched so it is
+ * only marked here and freed afterwards.
+ */
+void
+event_remove(struct event *ev)
+{
+    struct event **p;
+
+    if (!ev || ev->removed)
+        return;
+
+    for (p = &loop.active; *p != ev; p = &(*p)->next)
+        ;
+    *p = ev->next;
+
+    epoll_ctl(loop.epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+    if (ev->timer)
+        close(ev->fd);
+
+    ev->removed = true;
+    ev->next = loop.removed;
+    loop.removed = ev;
+}
+
+bool
+event_dispatch(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct event *ev;
+    uint64_t expirations;
+    int i, n;
+
+    n = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return true;
+        ERR("epoll_wait failed: %d, %s\n", errno, strerror(errno));
+        return false;
+    }
+
+    for (i = 0; i < n; i++) {
+        ev = events[i].data.ptr;
+        if (ev->removed)
+            continue;
+
+        if (ev->timer &&
+            read(ev->fd, &expirations, sizeof(expirations)) < 0)
+            continue;
+
+        ev->fn(ev->opaque);
+    }
+
+    free_removed();
+
+    return true;
+}
@@ -64,9 +64,12 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
+#include <openssl/bio.h>
 #include <openssl/objects.h>
 #include <openssl/rsa.h>
 #include <openssl/x509.h>
@@ -74,6 +77,7 @@
 #include <openssl/pkcs7.h>
 #include <openssl/err.h>
 
+#include <arena.h>
 #include <backend.h>
 #include <debug.h>
 #include <efi.h>
@@ -82,6 +86,7 @@
 #include <handler.h>
 #include <mor.h>
 #include <ppi.h>
+#include <varstore.h>
 
 struct auth_info {
     const char *pretty_name;
@@ -145,6 +150,48 @@ static const uint8_t EFI_IMAGE_SECURITY_DATABASE[] = {'d',0,'b',0};
 static const uint8_t EFI_IMAGE_SECURITY_DATABASE1[] = {'d',0,'b',0,'x',0};
 static const uint8_t EFI_IMAGE_SECURITY_DATABASE2[] = {'d',0,'b',0,'t',0};
 
+/*
+ * Variables which get special treatment from SetVariable. Each request is
+ * classified once against var_classes and later checks switch on the kind.
+ */
+enum var_kind {
+    VAR_KIND_PLAIN,
+    VAR_KIND_PK,
+    VAR_KIND_KEK,
+    VAR_KIND_DB, /* db, dbx and dbt */
+    VAR_KIND_READ_ONLY,
+    VAR_KIND_MOR_CONTROL,
+    VAR_KIND_MOR_CONTROL_LOCK,
+    VAR_KIND_PPI_FLAGS,
+    VAR_KIND_PPI_FLAGS_LOCK,
+};
+
+struct var_class {
+    const uint8_t *name;
+    UINTN name_len;
+    const EFI_GUID *guid;
+    enum var_kind kind;
+};
+
+#define VAR_CLASS(_name, _guid, _kind) {_name, sizeof(_name), _guid, _kind}
+
+static const struct var_class var_classes[] = {
+    VAR_CLASS(EFI_PLATFORM_KEY_NAME, &gEfiGlobalVariableGuid, VAR_KIND_PK),
+    VAR_CLASS(EFI_KEY_EXCHANGE_KEY_NAME, &gEfiGlobalVariableGuid, VAR_KIND_KEK),
+    VAR_CLASS(EFI_IMAGE_SECURITY_DATABASE, &gEfiImageSecurityDatabaseGuid, VAR_KIND_DB),
+    VAR_CLASS(EFI_IMAGE_SECURITY_DATABASE1, &gEfiImageSecurityDatabaseGuid, VAR_KIND_DB),
+    VAR_CLASS(EFI_IMAGE_SECURITY_DATABASE2, &gEfiImageSecurityDatabaseGuid, VAR_KIND_DB),
+    VAR_CLASS(EFI_AUDIT_MODE_NAME, &gEfiGlobalVariableGuid, VAR_KIND_READ_ONLY),
+    VAR_CLASS(EFI_DEPLOYED_MODE_NAME, &gEfiGlobalVariableGuid, VAR_KIND_READ_ONLY),
+    VAR_CLASS(EFI_SECURE_BOOT_MODE_NAME, &gEfiGlobalVariableGuid, VAR_KIND_READ_ONLY),
+    VAR_CLASS(EFI_SETUP_MODE_NAME, &gEfiGlobalVariableGuid, VAR_KIND_READ_ONLY),
+    VAR_CLASS(EFI_SIGNATURE_SUPPORT_NAME, &gEfiGlobalVariableGuid, VAR_KIND_READ_ONLY),
+    VAR_CLASS(MOR_CONTROL_NAME, &morControlGuid, VAR_KIND_MOR_CONTROL),
+    VAR_CLASS(MOR_CONTROL_LOCK_NAME, &morControlLockGuid, VAR_KIND_MOR_CONTROL_LOCK),
+    VAR_CLASS(TCG2_PHYSICAL_PRESENCEFLAGS_NAME, &gEfiTcg2PpiXenGuid, VAR_KIND_PPI_FLAGS),
+    VAR_CLASS(TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME, &gEfiTcg2PpiXenGuid, VAR_KIND_PPI_FLAGS_LOCK),
+};
+
 #define AUTH_PATH_PREFIX "/var/lib/varstored"
 
 /*
@@ -169,19 +216,65 @@ bool secure_boot_enable;
 bool auth_enforce = true;
 bool persistent = true;
 
-static uint64_t
-get_space_usage(void)
+/*
+ * With one worker per vCPU, commands that only read the store run
+ * concurrently under a shared lock; anything that may change it is
+ * serialized. Writers are preferred so that a stream of GetVariable calls
+ * cannot hold off a SetVariable indefinitely.
+ */
+static pthread_rwlock_t store_lock =
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+void
+store_lock_shared(void)
 {
-    struct efi_variable *l;
-    uint64_t total = 0;
+    pthread_rwlock_rdlock(&store_lock);
+}
+
+void
+store_lock_exclusive(void)
+{
+    pthread_rwlock_wrlock(&store_lock);
+}
+
+void
+store_unlock(void)
+{
+    pthread_rwlock_unlock(&store_lock);
+}
+
+/*
+ * Everything allocated while handling a command comes from this per-thread
+ * arena, including the copies of the name and data taken from the guest's
+ * buffer, and is released in one go when the command completes. It is sized
+ * for the worst case SetVariable: the name and data, plus the signature,
+ * the buffer it is verified against and a copy of a certificate.
+ */
+#define REQUEST_ARENA_SIZE (8 * SHMEM_SIZE)
+
+static __thread struct arena req_arena;
+
+void
+free_request_arena(void)
+{
+    arena_destroy(&req_arena);
+}
 
-    l = var_list;
-    while (l) {
-        total += l->name_len + l->data_len + VARIABLE_SIZE_OVERHEAD;
-        l = l->next;
+static enum var_kind
+classify_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid)
+{
+    const struct var_class *c;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(var_classes); i++) {
+        c = &var_classes[i];
+        if (c->name_len == name_len &&
+                !memcmp(c->name, name, name_len) &&
+                !memcmp(c->guid, guid, GUID_LEN))
+            return c->kind;
     }
 
-    return total;
+    return VAR_KIND_PLAIN;
 }
 
 /* A limited version of SetVariable for internal use. */
@@ -190,45 +283,22 @@ internal_set_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
                       const uint8_t *data, UINTN data_len, UINT32 attr)
 {
     struct efi_variable *l;
-    uint8_t *new_data;
 
-    new_data = malloc(data_len);
-    if (!new_data)
-        return EFI_DEVICE_ERROR;
-    memcpy(new_data, data, data_len);
-
-    l = var_list;
-    while (l) {
-        if (l->name_len == name_len &&
-                !memcmp(l->name, name, name_len) &&
-                !memcmp(&l->guid, guid, GUID_LEN)) {
-            free(l->data);
-            l->data = new_data;
-            l->data_len = data_len;
-            return EFI_SUCCESS;
-        }
-        l = l->next;
+    l = varstore_lookup(name, name_len, guid);
+    if (l) {
+        if (!varstore_set_data(l, data, data_len))
+            return EFI_DEVICE_ERROR;
+        return EFI_SUCCESS;
     }
 
-    l = calloc(1, sizeof *l);
-    if (!l) {
-        free(new_data);
+    l = varstore_new(name, name_len, guid, data, data_len);
+    if (!l)
         return EFI_DEVICE_ERROR;
-    }
-    l->name = malloc(name_len);
-    if (!l->name) {
-        free(l);
-        free(new_data);
+    l->attributes = attr;
+    if (!varstore_insert(l)) {
+        varstore_free(l);
         return EFI_DEVICE_ERROR;
     }
-    memcpy(l->name, name, name_len);
-    l->name_len = name_len;
-    memcpy(&l->guid, guid, GUID_LEN);
-    l->data = new_data;
-    l->data_len = data_len;
-    l->attributes = attr;
-    l->next = var_list;
-    var_list = l;
 
     return EFI_SUCCESS;
 }
@@ -240,23 +310,37 @@ internal_get_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
 {
     struct efi_variable *l;
 
-    l = var_list;
-    while (l) {
-        if (l->name_len == name_len &&
-                !memcmp(l->name, name, name_len) &&
-                !memcmp(&l->guid, guid, GUID_LEN)) {
-
-            *data = malloc(l->data_len);
-            if (!*data)
-                return EFI_DEVICE_ERROR;
-            memcpy(*data, l->data, l->data_len);
-            *data_len = l->data_len;
-            return EFI_SUCCESS;
-        }
-        l = l->next;
-    }
+    l = varstore_lookup(name, name_len, guid);
+    if (!l)
+        return EFI_NOT_FOUND;
+
+    *data = malloc(l->data_len);
+    if (!*data)
+        return EFI_DEVICE_ERROR;
+    memcpy(*data, l->data, l->data_len);
+    *data_len = l->data_len;
+
+    return EFI_SUCCESS;
+}
+
+/*
+ * As internal_get_variable() but returns a pointer to the stored data rather
+ * than a copy. The view is only valid until the store is next modified.
+ */
+EFI_STATUS
+internal_view_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+                       const uint8_t **data, UINTN *data_len)
+{
+    struct efi_variable *l;
+
+    l = varstore_lookup(name, name_len, guid);
+    if (!l)
+        return EFI_NOT_FOUND;
+
+    *data = l->data;
+    *data_len = l->data_len;
 
-    return EFI_NOT_FOUND;
+    return EFI_SUCCESS;
 }
 
 static void
@@ -271,7 +355,7 @@ do_get_variable(uint8_t *comm_buf)
     ptr = comm_buf;
     unserialize_uint32(&ptr); /* version */
     unserialize_command(&ptr);
-    name = unserialize_data(&ptr, &name_len, NAME_LIMIT);
+    name = unserialize_data_arena(&ptr, &name_len, NAME_LIMIT, &req_arena);
     if (!name) {
         serialize_result(&comm_buf, name_len == 0 ? EFI_NOT_FOUND : EFI_DEVICE_ERROR);
         return;
@@ -281,32 +365,17 @@ do_get_variable(uint8_t *comm_buf)
     at_runtime = unserialize_boolean(&ptr);
 
     ptr = comm_buf;
-    l = var_list;
-    while (l) {
-        if (l->name_len == name_len &&
-                !memcmp(l->name, name, name_len) &&
-                !memcmp(&l->guid, &guid, GUID_LEN)) {
-            if (at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS)) {
-                l = l->next;
-                continue;
-            }
-            if (data_len < l->data_len) {
-                serialize_result(&ptr, EFI_BUFFER_TOO_SMALL);
-                serialize_uintn(&ptr, l->data_len);
-            } else {
-                serialize_result(&ptr, EFI_SUCCESS);
-                serialize_uint32(&ptr, l->attributes);
-                serialize_data(&ptr, l->data, l->data_len);
-            }
-            goto out;
-        }
-        l = l->next;
+    l = varstore_lookup(name, name_len, &guid);
+    if (!l || (at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS))) {
+        serialize_result(&ptr, EFI_NOT_FOUND);
+    } else if (data_len < l->data_len) {
+        serialize_result(&ptr, EFI_BUFFER_TOO_SMALL);
+        serialize_uintn(&ptr, l->data_len);
+    } else {
+        serialize_result(&ptr, EFI_SUCCESS);
+        serialize_uint32(&ptr, l->attributes);
+        serialize_data(&ptr, l->data, l->data_len);
     }
-
-    serialize_result(&ptr, EFI_NOT_FOUND);
-
-out:
-    free(name);
 }
 
 static X509 *
@@ -323,7 +392,9 @@ X509_to_buf(X509 *cert, int *len)
     uint8_t *ptr, *buf;
 
     *len = i2d_X509(cert, NULL);
-    buf = malloc(*len);
+    if (*len < 0)
+        return NULL;
+    buf = arena_alloc(&req_arena, *len);
     if (!buf)
         return NULL;
     ptr = buf;
@@ -336,7 +407,7 @@ X509_to_buf(X509 *cert, int *len)
  * Get the TBS certificate from an X509 certificate.
  * Adapted from edk2.
  *
- * tbs_cert should be freed by the caller.
+ * tbs_cert is allocated from the request arena.
  */
 static EFI_STATUS
 X509_get_tbs_cert(X509 *cert, uint8_t **tbs_cert, UINTN *tbs_len)
@@ -353,27 +424,18 @@ X509_get_tbs_cert(X509 *cert, uint8_t **tbs_cert, UINTN *tbs_len)
     tmp_len = 0;
     ret = ASN1_get_object((const unsigned char **)&ptr, &tmp_len, &asn1_tag,
                           &obj_class, len);
-    if (ret == 0x80 || asn1_tag != V_ASN1_SEQUENCE) {
-        free(buf);
+    if (ret == 0x80 || asn1_tag != V_ASN1_SEQUENCE)
         return EFI_SECURITY_VIOLATION;
-    }
 
     tbs_ptr = ptr;
     ret = ASN1_get_object((const unsigned char **)&ptr, &tmp_len, &asn1_tag,
                           &obj_class, tmp_len);
-    if (ret == 0x80 || asn1_tag != V_ASN1_SEQUENCE) {
-        free(buf);
+    if (ret == 0x80 || asn1_tag != V_ASN1_SEQUENCE)
         return EFI_SECURITY_VIOLATION;
-    }
 
+    /* The TBS certificate is used in place within the encoding. */
     *tbs_len = tmp_len + (ptr - tbs_ptr);
-    *tbs_cert = malloc(*tbs_len);
-    if (!*tbs_cert) {
-        free(buf);
-        return EFI_DEVICE_ERROR;
-    }
-    memcpy(*tbs_cert, tbs_ptr, *tbs_len);
-    free(buf);
+    *tbs_cert = tbs_ptr;
 
     return EFI_SUCCESS;
 }
@@ -423,7 +485,6 @@ sha256_sig(STACK_OF(X509) *certs, X509 *top_level_cert, uint8_t *digest)
 
     status = EFI_SUCCESS;
 out:
-    free(tbs_cert);
     return status;
 }
 
@@ -494,14 +555,50 @@ X509_verify_cb(int status, X509_STORE_CTX *context)
 #define OPENSSL_NO_CHECK_TIME X509_V_FLAG_NO_CHECK_TIME
 #endif
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Accessors that OpenSSL 1.0.2 lacks. */
+static const ASN1_OCTET_STRING *
+X509_get0_subject_key_id(X509 *x)
+{
+    /* Caches the extensions. */
+    X509_check_purpose(x, -1, -1);
+    return x->skid;
+}
+
+static const ASN1_OCTET_STRING *
+X509_get0_authority_key_id(X509 *x)
+{
+    X509_check_purpose(x, -1, -1);
+    return x->akid ? x->akid->keyid : NULL;
+}
+
+static void *
+BIO_get_data(BIO *b)
+{
+    return b->ptr;
+}
+
+static void
+BIO_set_data(BIO *b, void *ptr)
+{
+    b->ptr = ptr;
+}
+
+static void
+BIO_set_init(BIO *b, int init)
+{
+    b->init = init;
+}
+#endif
+
 /*
  * Check whether input p7data is a wrapped ContentInfo structure or not. Wrap
  * it if needed. While the specification seems to indicate that it should not
  * be wrapped (i.e. it should just be signed data), edk2 accepts either and at
  * least one existing tool signs SetVariable updates with a wrapped structure.
  * Adapted from edk2. This function contains several magic numbers since it is
- * parsing DER-encoded PKCS #7 ASN.1 object by hand. The caller must free
- * wrap_data on success.
+ * parsing DER-encoded PKCS #7 ASN.1 object by hand. wrap_data is allocated
+ * from the request arena.
  */
 static EFI_STATUS
 wrap_pkcs7_data(const uint8_t *p7data, UINTN p7_len,
@@ -521,16 +618,15 @@ wrap_pkcs7_data(const uint8_t *p7data, UINTN p7_len,
     if ((p7data[4] == 0x06) && (p7data[5] == 0x09) &&
             !memcmp(p7data + 6, mOidValue, sizeof(mOidValue)) &&
             (p7data[15] == 0xa0) && (p7data[16] == 0x82)) {
-        *wrap_data = malloc(p7_len);
+        *wrap_data = arena_memdup(&req_arena, p7data, p7_len);
         if (!*wrap_data)
             return EFI_DEVICE_ERROR;
-        memcpy(*wrap_data, p7data, p7_len);
         *wrap_len = p7_len;
         return EFI_SUCCESS;
     }
 
     *wrap_len = p7_len + 19;
-    *wrap_data = malloc(*wrap_len);
+    *wrap_data = arena_alloc(&req_arena, *wrap_len);
     if (!*wrap_data)
         return EFI_DEVICE_ERROR;
 
@@ -551,61 +647,300 @@ wrap_pkcs7_data(const uint8_t *p7data, UINTN p7_len,
     return EFI_SUCCESS;
 }
 
+/* Returns a store that trusts only trusted_cert, or NULL on failure. */
+static X509_STORE *
+new_trust_store(X509 *trusted_cert)
+{
+    X509_STORE *cert_store;
+
+    cert_store = X509_STORE_new();
+    if (!cert_store)
+        return NULL;
+
+#ifndef X509_V_FLAG_NO_CHECK_TIME
+    cert_store->verify_cb = X509_verify_cb;
+#endif
+
+    if (!(X509_STORE_add_cert(cert_store, trusted_cert))) {
+        X509_STORE_free(cert_store);
+        return NULL;
+    }
+
+    X509_STORE_set_flags(cert_store,
+                         X509_V_FLAG_PARTIAL_CHAIN | OPENSSL_NO_CHECK_TIME);
+    X509_STORE_set_purpose(cert_store, X509_PURPOSE_ANY);
+
+    return cert_store;
+}
+
 /*
- * Verify the validity of PKCS#7 data.
- * Adapted from edk2.
+ * Stores for each X509 certificate in the signature database of a trust
+ * anchor variable (PK or KEK). They are rebuilt only when the generation of
+ * the variable changes, rather than parsing every certificate and building a
+ * new store on each authenticated write.
+ */
+struct trust_anchor {
+    X509 *cert;
+    X509_STORE *store;
+};
+
+struct trust_cache {
+    uint64_t generation; /* 0 when empty */
+    struct trust_anchor *anchors;
+    int count;
+};
+
+static struct trust_cache pk_trust, kek_trust;
+
+static void
+trust_cache_clear(struct trust_cache *tc)
+{
+    int i;
+
+    for (i = 0; i < tc->count; i++) {
+        X509_STORE_free(tc->anchors[i].store);
+        X509_free(tc->anchors[i].cert);
+    }
+    free(tc->anchors);
+    tc->anchors = NULL;
+    tc->count = 0;
+    tc->generation = 0;
+}
+
+/*
+ * var must hold a signature database that was validated when it was written.
+ * Certificates that fail to parse are skipped, as they would never verify.
  */
 static EFI_STATUS
-pkcs7_verify(const uint8_t *p7data, UINTN p7_len, X509 *trusted_cert,
-             uint8_t *verify_buf, UINTN verify_len)
+trust_cache_get(struct trust_cache *tc, const struct efi_variable *var)
 {
-    EFI_STATUS status;
-    const uint8_t *ptr;
-    PKCS7 *pkcs7 = NULL;
-    BIO *data_bio = NULL;
-    X509_STORE *cert_store = NULL;
+    EFI_SIGNATURE_LIST *cert_list;
+    EFI_SIGNATURE_DATA *cert;
+    X509_STORE *store;
+    X509 *trusted_cert;
+    int remaining, i, count;
 
-    ptr = p7data;
-    pkcs7 = d2i_PKCS7(NULL, &ptr, (int)p7_len);
-    if (!pkcs7) {
-        status = EFI_SECURITY_VIOLATION;
-        goto out;
+    if (tc->generation == var->generation)
+        return EFI_SUCCESS;
+
+    trust_cache_clear(tc);
+
+    /* Each entry is at least EFI_SIG_DATA_SIZE bytes. */
+    tc->anchors = malloc((var->data_len / EFI_SIG_DATA_SIZE + 1) *
+                         sizeof(*tc->anchors));
+    if (!tc->anchors)
+        return EFI_DEVICE_ERROR;
+
+    remaining = (UINT32)var->data_len;
+    cert_list = (EFI_SIGNATURE_LIST *)var->data;
+    while (remaining > 0) {
+        if (!memcmp(&cert_list->SignatureType, &gEfiCertX509Guid, GUID_LEN)) {
+            cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert_list +
+                   sizeof(EFI_SIGNATURE_LIST) + cert_list->SignatureHeaderSize);
+            count  = (cert_list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
+                      cert_list->SignatureHeaderSize) / cert_list->SignatureSize;
+
+            for (i = 0; i < count; i++) {
+                trusted_cert = X509_from_buf(cert->SignatureData,
+                    cert_list->SignatureSize - EFI_SIG_DATA_SIZE);
+                if (trusted_cert) {
+                    store = new_trust_store(trusted_cert);
+                    if (!store) {
+                        X509_free(trusted_cert);
+                        trust_cache_clear(tc);
+                        return EFI_DEVICE_ERROR;
+                    }
+                    tc->anchors[tc->count].cert = trusted_cert;
+                    tc->anchors[tc->count].store = store;
+                    tc->count++;
+                }
+                cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert +
+                       cert_list->SignatureSize);
+            }
+        }
+        remaining -= cert_list->SignatureListSize;
+        cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)cert_list +
+                    cert_list->SignatureListSize);
     }
 
-    if (!PKCS7_type_is_signed(pkcs7)) {
-        status = EFI_SECURITY_VIOLATION;
-        goto out;
+    tc->generation = var->generation;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Returns whether the chain of a signer of pkcs7 may end at anchor, judging
+ * only by the issuer, serial number and key identifiers that the signature
+ * carries. This is used to choose which anchors to verify against first.
+ */
+static bool
+anchor_matches(const struct trust_anchor *anchor, PKCS7 *pkcs7)
+{
+    STACK_OF(PKCS7_SIGNER_INFO) *sinfos;
+    PKCS7_ISSUER_AND_SERIAL *ias;
+    STACK_OF(X509) *certs;
+    const ASN1_OCTET_STRING *skid, *akid;
+    X509_NAME *subject;
+    X509 *cert;
+    int i;
+
+    subject = X509_get_subject_name(anchor->cert);
+    skid = X509_get0_subject_key_id(anchor->cert);
+
+    /* The signer is the anchor or was issued by it. */
+    sinfos = PKCS7_get_signer_info(pkcs7);
+    for (i = 0; i < sk_PKCS7_SIGNER_INFO_num(sinfos); i++) {
+        ias = sk_PKCS7_SIGNER_INFO_value(sinfos, i)->issuer_and_serial;
+        if (!ias)
+            continue;
+        if (!X509_NAME_cmp(ias->issuer, subject))
+            return true;
+        if (!X509_NAME_cmp(ias->issuer, X509_get_issuer_name(anchor->cert)) &&
+                !ASN1_INTEGER_cmp(ias->serial,
+                                  X509_get_serialNumber(anchor->cert)))
+            return true;
     }
 
-    cert_store = X509_STORE_new();
-    if (!cert_store) {
-        status = EFI_DEVICE_ERROR;
-        goto out;
+    /* Some certificate in the chain was issued by the anchor. */
+    certs = pkcs7->d.sign->cert;
+    for (i = 0; i < sk_X509_num(certs); i++) {
+        cert = sk_X509_value(certs, i);
+        if (!X509_NAME_cmp(X509_get_issuer_name(cert), subject))
+            return true;
+        akid = X509_get0_authority_key_id(cert);
+        if (skid && akid && !ASN1_OCTET_STRING_cmp(skid, akid))
+            return true;
     }
 
-#ifndef X509_V_FLAG_NO_CHECK_TIME
-    cert_store->verify_cb = X509_verify_cb;
-#endif
+    return false;
+}
 
-    if (!(X509_STORE_add_cert(cert_store, trusted_cert))) {
-        status = EFI_SECURITY_VIOLATION;
-        goto out;
+/*
+ * A read-only source BIO over a list of buffers, so that signed content that
+ * is scattered across a request can be digested without concatenating it.
+ */
+struct iov_source {
+    const struct iovec *iov;
+    int iovcnt;
+    int idx;
+    size_t off;
+};
+
+static int
+iov_bio_read(BIO *b, char *out, int len)
+{
+    struct iov_source *src = BIO_get_data(b);
+    const struct iovec *iov;
+    size_t n;
+    int done = 0;
+
+    BIO_clear_retry_flags(b);
+
+    while (done < len && src->idx < src->iovcnt) {
+        iov = &src->iov[src->idx];
+        n = iov->iov_len - src->off;
+        if (n > (size_t)(len - done))
+            n = len - done;
+
+        memcpy(out + done, (uint8_t *)iov->iov_base + src->off, n);
+        done += n;
+        src->off += n;
+        if (src->off == iov->iov_len) {
+            src->idx++;
+            src->off = 0;
+        }
     }
 
-    data_bio = BIO_new(BIO_s_mem());
-    if (!data_bio) {
-        status = EFI_DEVICE_ERROR;
-        goto out;
+    return done;
+}
+
+static long
+iov_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+    struct iov_source *src = BIO_get_data(b);
+
+    switch (cmd) {
+    case BIO_CTRL_EOF:
+        return src->idx == src->iovcnt;
+    case BIO_CTRL_RESET:
+        src->idx = 0;
+        src->off = 0;
+        return 1;
+    case BIO_CTRL_FLUSH:
+        return 1;
+    default:
+        return 0;
     }
+}
 
-    if (BIO_write(data_bio, verify_buf, (int)verify_len) != verify_len) {
-        status = EFI_SECURITY_VIOLATION;
-        goto out;
+static int
+iov_bio_create(BIO *b)
+{
+    BIO_set_init(b, 1);
+    return 1;
+}
+
+/* Returns a BIO reading from iovcnt buffers at iov, or NULL on failure. */
+static BIO *
+iov_bio_new(struct iov_source *src, const struct iovec *iov, int iovcnt)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    static BIO_METHOD iov_method = {
+        .type = BIO_TYPE_SOURCE_SINK,
+        .name = "iovec source",
+        .bread = iov_bio_read,
+        .ctrl = iov_bio_ctrl,
+        .create = iov_bio_create,
+    };
+    static BIO_METHOD *method = &iov_method;
+#else
+    static BIO_METHOD *method;
+#endif
+    BIO *b;
+
+    if (!method) {
+        method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                              "iovec source");
+        if (!method)
+            return NULL;
+        BIO_meth_set_read(method, iov_bio_read);
+        BIO_meth_set_ctrl(method, iov_bio_ctrl);
+        BIO_meth_set_create(method, iov_bio_create);
     }
 
-    X509_STORE_set_flags(cert_store,
-                         X509_V_FLAG_PARTIAL_CHAIN | OPENSSL_NO_CHECK_TIME);
-    X509_STORE_set_purpose(cert_store, X509_PURPOSE_ANY);
+    b = BIO_new(method);
+    if (!b)
+        return NULL;
+
+    src->iov = iov;
+    src->iovcnt = iovcnt;
+    src->idx = 0;
+    src->off = 0;
+    BIO_set_data(b, src);
+
+    return b;
+}
+
+/*
+ * Verify the validity of PKCS#7 signed data against cert_store. The detached
+ * content is the concatenation of the iovcnt buffers at iov.
+ * Adapted from edk2.
+ */
+static EFI_STATUS
+pkcs7_verify(PKCS7 *pkcs7, X509_STORE *cert_store,
+             const struct iovec *iov, int iovcnt)
+{
+    EFI_STATUS status;
+    struct iov_source src;
+    BIO *data_bio = NULL;
+
+    if (!pkcs7)
+        return EFI_SECURITY_VIOLATION;
+
+    data_bio = iov_bio_new(&src, iov, iovcnt);
+    if (!data_bio) {
+        status = EFI_DEVICE_ERROR;
+        goto out;
+    }
 
     if (PKCS7_verify(pkcs7, NULL, cert_store, data_bio, NULL, PKCS7_BINARY))
         status = EFI_SUCCESS;
@@ -620,44 +955,25 @@ pkcs7_verify(const uint8_t *p7data, UINTN p7_len, X509 *trusted_cert,
 
 out:
     BIO_free(data_bio);
-    X509_STORE_free(cert_store);
-    PKCS7_free(pkcs7);
     return status;
 }
 
-/*
- * Get the signer's certificates from PKCS#7 signed data.
- * Adapted from edk2.
- *
- * The caller is responsible for free the pkcs7 context and the stack of certs
- * (but not the certs themselves). The certs should not be used after the
- * context is freed.
- */
+/* As pkcs7_verify() but trusting only trusted_cert. */
 static EFI_STATUS
-pkcs7_get_signers(const uint8_t *p7data, UINTN p7_len,
-                  PKCS7 **pkcs7, STACK_OF(X509) **certs)
+pkcs7_verify_cert(PKCS7 *pkcs7, X509 *trusted_cert,
+                  const struct iovec *iov, int iovcnt)
 {
-    const uint8_t *ptr;
-
-    ptr = p7data;
-    *pkcs7 = d2i_PKCS7(NULL, &ptr, (int)p7_len);
-    if (!*pkcs7)
-        return EFI_SECURITY_VIOLATION;
+    X509_STORE *cert_store;
+    EFI_STATUS status;
 
-    if (!PKCS7_type_is_signed(*pkcs7)) {
-        PKCS7_free(*pkcs7);
-        *pkcs7 = NULL;
+    cert_store = new_trust_store(trusted_cert);
+    if (!cert_store)
         return EFI_SECURITY_VIOLATION;
-    }
 
-    *certs = PKCS7_get0_signers(*pkcs7, NULL, PKCS7_BINARY);
-    if (!*certs) {
-        PKCS7_free(*pkcs7);
-        *pkcs7 = NULL;
-        return EFI_SECURITY_VIOLATION;
-    }
+    status = pkcs7_verify(pkcs7, cert_store, iov, iovcnt);
+    X509_STORE_free(cert_store);
 
-    return EFI_SUCCESS;
+    return status;
 }
 
 /* Returns true iff b is later than a */
@@ -796,31 +1112,37 @@ check_signature_list_format(uint8_t *data, UINTN data_len, bool is_pk)
     return EFI_SUCCESS;
 }
 
+#define VERIFY_IOVCNT 5
+
 /*
- * Verify the authentication descriptor for a time based authentication
- * variable.
- *
- * On success, payload_out and payload_len_out refer to the actual payload.
- * The caller is responsible for freeing.
- * digest is the digest of the signer's certificates.
- * timestamp is the associated with the descriptor.
+ * An authentication descriptor parsed once so that it can be checked against
+ * several trust anchors in turn.
+ */
+struct auth_desc {
+    uint8_t *payload; /* Within the caller's data */
+    UINTN payload_len;
+    uint8_t *sig; /* As found in the descriptor */
+    UINTN sig_len;
+    UINT32 verify_attr;
+    /* The signed content: name, GUID, attributes, timestamp and payload */
+    struct iovec verify_iov[VERIFY_IOVCNT];
+    PKCS7 *pkcs7;
+    STACK_OF(X509) *signers; /* Looked up on first use */
+};
+
+/*
+ * Parses the descriptor at the start of data, checking its format and, if
+ * is_signed, its timestamp against cur. The signature itself is left to
+ * parse_auth_sig().
  */
 static EFI_STATUS
-verify_auth_var_type(uint8_t *name, UINTN name_len,
-                     uint8_t *data, UINTN data_len,
-                     EFI_GUID *guid, UINT32 attr, bool append,
-                     struct efi_variable *cur, enum auth_type auth_type,
-                     uint8_t **payload_out, UINTN *payload_len_out,
-                     uint8_t *digest, EFI_TIME *timestamp)
+parse_auth_desc(struct auth_desc *ad, uint8_t *name, UINTN name_len,
+                uint8_t *data, UINTN data_len, EFI_GUID *guid, UINT32 attr,
+                bool append, struct efi_variable *cur, bool is_signed,
+                EFI_TIME *timestamp)
 {
-    uint8_t *ptr, *sig = NULL, *payload, *verify_buf = NULL, *tlc_buf = NULL;
-    uint8_t *var_data = NULL;
     EFI_VARIABLE_AUTHENTICATION_2 *d;
-    UINTN sig_len, verify_len, payload_len, var_len;
-    STACK_OF(X509) *certs = NULL;
-    X509 *top_level_cert;
-    PKCS7 *pkcs7 = NULL;
-    EFI_STATUS status;
+    UINTN sig_len;
 
     if (data_len < offsetof(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo.CertData))
         return EFI_SECURITY_VIOLATION;
@@ -835,7 +1157,7 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
             (timestamp->Pad2 != 0))
         return EFI_SECURITY_VIOLATION;
 
-    if (auth_enforce && auth_type != AUTH_TYPE_NONE && !append && cur &&
+    if (auth_enforce && is_signed && !append && cur &&
             !time_later(&cur->timestamp, timestamp))
         return EFI_SECURITY_VIOLATION;
 
@@ -847,212 +1169,217 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
     if (sig_len > (data_len - offsetof(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo.CertData)))
         return EFI_SECURITY_VIOLATION;
 
-    payload = d->AuthInfo.CertData + sig_len;
-    payload_len = data_len - offsetof(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo) - d->AuthInfo.Hdr.dwLength;
+    ad->sig = d->AuthInfo.CertData;
+    ad->sig_len = sig_len;
+    ad->payload = d->AuthInfo.CertData + sig_len;
+    ad->payload_len = data_len - offsetof(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo) - d->AuthInfo.Hdr.dwLength;
 
-    if (auth_type == AUTH_TYPE_NONE) {
-        sig = malloc(sig_len);
-        if (!sig)
-            return EFI_DEVICE_ERROR;
-        memcpy(sig, d->AuthInfo.CertData, sig_len);
-    } else {
-        status = wrap_pkcs7_data(d->AuthInfo.CertData, sig_len, &sig, &sig_len);
-        if (status != EFI_SUCCESS)
-            goto out;
+    /* VariableName, VendorGuid, Attributes, TimeStamp, Data */
+    ad->verify_attr = attr;
+    if (append)
+        ad->verify_attr |= EFI_VARIABLE_APPEND_WRITE;
+    ad->verify_iov[0].iov_base = name;
+    ad->verify_iov[0].iov_len = name_len;
+    ad->verify_iov[1].iov_base = guid;
+    ad->verify_iov[1].iov_len = GUID_LEN;
+    ad->verify_iov[2].iov_base = &ad->verify_attr;
+    ad->verify_iov[2].iov_len = sizeof ad->verify_attr;
+    ad->verify_iov[3].iov_base = &d->TimeStamp;
+    ad->verify_iov[3].iov_len = sizeof d->TimeStamp;
+    ad->verify_iov[4].iov_base = ad->payload;
+    ad->verify_iov[4].iov_len = ad->payload_len;
 
-        /*
-         * Verify that the signature uses a digest algorithm of SHA-256 as
-         * required by the specification.  Assumes that two-byte length
-         * encoding has been used. Adapted from edk2.
-         */
-        if (sig_len >= (32 + sizeof(mSha256OidValue)) &&
-                ((sig[20] != 0x82) ||
-                 memcmp(sig + 32, &mSha256OidValue, sizeof(mSha256OidValue)))) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
+    return EFI_SUCCESS;
+}
+
+/* Parses the PKCS#7 signature of a descriptor from parse_auth_desc(). */
+static EFI_STATUS
+parse_auth_sig(struct auth_desc *ad)
+{
+    uint8_t *sig;
+    const uint8_t *p7_ptr;
+    UINTN sig_len;
+    EFI_STATUS status;
+
+    status = wrap_pkcs7_data(ad->sig, ad->sig_len, &sig, &sig_len);
+    if (status != EFI_SUCCESS)
+        return status;
+
+    /*
+     * Verify that the signature uses a digest algorithm of SHA-256 as
+     * required by the specification.  Assumes that two-byte length
+     * encoding has been used. Adapted from edk2.
+     */
+    if (sig_len >= (32 + sizeof(mSha256OidValue)) &&
+            ((sig[20] != 0x82) ||
+             memcmp(sig + 32, &mSha256OidValue, sizeof(mSha256OidValue))))
+        return EFI_SECURITY_VIOLATION;
+
+    /*
+     * A bad signature is only rejected by the checks that use it so that,
+     * e.g., deleting a variable with AUTH_TYPE_PAYLOAD still succeeds.
+     */
+    p7_ptr = sig;
+    ad->pkcs7 = d2i_PKCS7(NULL, &p7_ptr, (int)sig_len);
+    if (ad->pkcs7 && !PKCS7_type_is_signed(ad->pkcs7)) {
+        PKCS7_free(ad->pkcs7);
+        ad->pkcs7 = NULL;
     }
 
-    /* VariableName, VendorGuid, Attributes, TimeStamp, Data */
-    verify_len = name_len + GUID_LEN + sizeof(UINT32) + sizeof(EFI_TIME) +
-                 payload_len;
-    verify_buf = malloc(verify_len);
-    if (!verify_buf) {
-        status = EFI_DEVICE_ERROR;
-        goto out;
+    return EFI_SUCCESS;
+}
+
+static void
+free_auth_desc(struct auth_desc *ad)
+{
+    sk_X509_free(ad->signers);
+    PKCS7_free(ad->pkcs7);
+}
+
+/*
+ * Returns the top level certificate of the signer's chain. It belongs to
+ * ad->pkcs7.
+ */
+static EFI_STATUS
+auth_desc_top_level_cert(struct auth_desc *ad, X509 **top_level_cert)
+{
+    if (!ad->pkcs7)
+        return EFI_SECURITY_VIOLATION;
+
+    if (!ad->signers) {
+        ad->signers = PKCS7_get0_signers(ad->pkcs7, NULL, PKCS7_BINARY);
+        if (!ad->signers)
+            return EFI_SECURITY_VIOLATION;
     }
+    if (sk_X509_num(ad->signers) == 0)
+        return EFI_SECURITY_VIOLATION;
 
-    ptr = verify_buf;
-    memcpy(ptr, name, name_len);
-    ptr += name_len;
-    memcpy(ptr, guid, GUID_LEN);
-    ptr += GUID_LEN;
-    if (append)
-        attr |= EFI_VARIABLE_APPEND_WRITE;
-    memcpy(ptr, &attr, sizeof attr);
-    ptr += sizeof attr;
-    memcpy(ptr, &d->TimeStamp, sizeof d->TimeStamp);
-    ptr += sizeof d->TimeStamp;
-    memcpy(ptr, payload, payload_len);
+    *top_level_cert = sk_X509_value(ad->signers,
+                                    sk_X509_num(ad->signers) - 1);
+    return EFI_SUCCESS;
+}
+
+/*
+ * Checks a descriptor parsed by parse_auth_desc() against the trust anchor
+ * for auth_type. digest is set for AUTH_TYPE_PRIVATE.
+ */
+static EFI_STATUS
+check_auth_desc(struct auth_desc *ad, enum auth_type auth_type,
+                struct efi_variable *cur, uint8_t *digest)
+{
+    EFI_STATUS status;
+    X509 *top_level_cert;
 
     if (auth_type == AUTH_TYPE_PK) {
         EFI_SIGNATURE_LIST *cert_list;
         EFI_SIGNATURE_DATA *cert;
+        struct efi_variable *pk;
+        uint8_t *tlc_buf;
         int tlc_len;
 
-        status = pkcs7_get_signers(sig, sig_len, &pkcs7, &certs);
+        status = auth_desc_top_level_cert(ad, &top_level_cert);
         if (status != EFI_SUCCESS)
-            goto out;
-        if (sk_X509_num(certs) == 0) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
-        top_level_cert = sk_X509_value(certs, sk_X509_num(certs) - 1);
+            return status;
 
         tlc_buf = X509_to_buf(top_level_cert, &tlc_len);
-        if (!tlc_buf) {
-            status = EFI_DEVICE_ERROR;
-            goto out;
-        }
+        if (!tlc_buf)
+            return EFI_DEVICE_ERROR;
 
-        status = internal_get_variable(EFI_PLATFORM_KEY_NAME,
-                                       sizeof(EFI_PLATFORM_KEY_NAME),
-                                       &gEfiGlobalVariableGuid,
-                                       &var_data, &var_len);
-        if (status != EFI_SUCCESS) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
+        pk = varstore_lookup(EFI_PLATFORM_KEY_NAME,
+                             sizeof(EFI_PLATFORM_KEY_NAME),
+                             &gEfiGlobalVariableGuid);
+        if (!pk)
+            return EFI_SECURITY_VIOLATION;
 
-        cert_list = (EFI_SIGNATURE_LIST *)var_data;
+        cert_list = (EFI_SIGNATURE_LIST *)pk->data;
         cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert_list +
                sizeof(EFI_SIGNATURE_LIST) + cert_list->SignatureHeaderSize);
         if ((tlc_len != (cert_list->SignatureSize - EFI_SIG_DATA_SIZE)) ||
-                memcmp(cert->SignatureData, tlc_buf, tlc_len)) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
+                memcmp(cert->SignatureData, tlc_buf, tlc_len))
+            return EFI_SECURITY_VIOLATION;
 
-        status = pkcs7_verify(sig, sig_len, top_level_cert,
-                              verify_buf, verify_len);
-        if (status == EFI_SUCCESS) {
-            *payload_len_out = payload_len;
-            *payload_out = malloc(payload_len);
-            if (*payload_out)
-                memcpy(*payload_out, payload, payload_len);
-            else
-                status = EFI_DEVICE_ERROR;
-        }
+        /* The signer's top level cert is the PK so its store can be used. */
+        status = trust_cache_get(&pk_trust, pk);
+        if (status != EFI_SUCCESS)
+            return status;
+        if (pk_trust.count != 1)
+            return EFI_SECURITY_VIOLATION;
+
+        return pkcs7_verify(ad->pkcs7, pk_trust.anchors[0].store,
+                            ad->verify_iov, VERIFY_IOVCNT);
     } else if (auth_type == AUTH_TYPE_KEK) {
-        EFI_SIGNATURE_LIST *cert_list;
-        EFI_SIGNATURE_DATA *cert;
-        int remaining, i, count;
-        X509 *trusted_cert;
+        struct efi_variable *kek;
+        int pass, i;
 
-        status = internal_get_variable(EFI_KEY_EXCHANGE_KEY_NAME,
-                                       sizeof(EFI_KEY_EXCHANGE_KEY_NAME),
-                                       &gEfiGlobalVariableGuid,
-                                       &var_data, &var_len);
-        if (status != EFI_SUCCESS) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
+        kek = varstore_lookup(EFI_KEY_EXCHANGE_KEY_NAME,
+                              sizeof(EFI_KEY_EXCHANGE_KEY_NAME),
+                              &gEfiGlobalVariableGuid);
+        if (!kek)
+            return EFI_SECURITY_VIOLATION;
 
-        remaining = (UINT32)var_len;
         /*
-         * cert_list (i.e. the contents of KEK) was verified to be valid when
-         * it was written. Therefore no checking of validity is needed here.
+         * The contents of KEK were verified to be valid when it was written.
+         * Therefore no checking of validity is needed here.
          */
-        cert_list = (EFI_SIGNATURE_LIST *)var_data;
-        while (remaining > 0) {
-            if (!memcmp(&cert_list->SignatureType, &gEfiCertX509Guid, GUID_LEN)) {
-                cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert_list +
-                       sizeof(EFI_SIGNATURE_LIST) + cert_list->SignatureHeaderSize);
-                count  = (cert_list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
-                          cert_list->SignatureHeaderSize) / cert_list->SignatureSize;
-
-                for (i = 0; i < count; i++) {
-                    trusted_cert = X509_from_buf(cert->SignatureData,
-                        cert_list->SignatureSize - EFI_SIG_DATA_SIZE);
-                    if (trusted_cert) {
-                        status = pkcs7_verify(sig, sig_len, trusted_cert,
-                                              verify_buf, verify_len);
-                        X509_free(trusted_cert);
-                        if (status == EFI_SUCCESS) {
-                            *payload_len_out = payload_len;
-                            *payload_out = malloc(payload_len);
-                            if (*payload_out)
-                                memcpy(*payload_out, payload, payload_len);
-                            else
-                                status = EFI_DEVICE_ERROR;
-                            goto out;
-                        }
-                    }
-                    cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert +
-                           cert_list->SignatureSize);
-                }
+        status = trust_cache_get(&kek_trust, kek);
+        if (status != EFI_SUCCESS)
+            return status;
+
+        if (!ad->pkcs7)
+            return EFI_SECURITY_VIOLATION;
+
+        /*
+         * Verify against the certs that the signature names first so that a
+         * large KEK doesn't cost a chain building attempt per cert. Then fall
+         * back to the remaining ones, since names and key identifiers are
+         * only hints.
+         */
+        for (pass = 0; pass < 2; pass++) {
+            for (i = 0; i < kek_trust.count; i++) {
+                if (anchor_matches(&kek_trust.anchors[i],
+                                   ad->pkcs7) != (pass == 0))
+                    continue;
+                if (pkcs7_verify(ad->pkcs7, kek_trust.anchors[i].store,
+                                 ad->verify_iov, VERIFY_IOVCNT) == EFI_SUCCESS)
+                    return EFI_SUCCESS;
             }
-            remaining -= cert_list->SignatureListSize;
-            cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)cert_list +
-                        cert_list->SignatureListSize);
         }
-        status = EFI_SECURITY_VIOLATION;
+        return EFI_SECURITY_VIOLATION;
     } else if (auth_type == AUTH_TYPE_PAYLOAD) {
         EFI_SIGNATURE_LIST *cert_list;
         EFI_SIGNATURE_DATA *cert;
         X509 *trusted_cert;
 
-        if (payload_len == 0) {
-            /* There is no payload therefore the variable will be deleted. */
-            *payload_len_out = payload_len;
-            *payload_out = NULL;
-            status = EFI_SUCCESS;
-            goto out;
-        } else if (payload_len < sizeof(*cert_list)) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
-
-        cert_list = (EFI_SIGNATURE_LIST *)payload;
-        if (payload_len < (sizeof(*cert_list) + cert_list->SignatureHeaderSize +
-                           cert_list->SignatureSize) ||
-                cert_list->SignatureSize < EFI_SIG_DATA_SIZE) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
+        /* There is no payload therefore the variable will be deleted. */
+        if (ad->payload_len == 0)
+            return EFI_SUCCESS;
+        if (ad->payload_len < sizeof(*cert_list))
+            return EFI_SECURITY_VIOLATION;
+
+        cert_list = (EFI_SIGNATURE_LIST *)ad->payload;
+        if (ad->payload_len < (sizeof(*cert_list) + cert_list->SignatureHeaderSize +
+                               cert_list->SignatureSize) ||
+                cert_list->SignatureSize < EFI_SIG_DATA_SIZE)
+            return EFI_SECURITY_VIOLATION;
         cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert_list +
                sizeof(EFI_SIGNATURE_LIST) + cert_list->SignatureHeaderSize);
         trusted_cert = X509_from_buf(cert->SignatureData,
                                      cert_list->SignatureSize - EFI_SIG_DATA_SIZE);
-        if (!trusted_cert) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
+        if (!trusted_cert)
+            return EFI_SECURITY_VIOLATION;
 
-        status = pkcs7_verify(sig, sig_len, trusted_cert,
-                              verify_buf, verify_len);
+        status = pkcs7_verify_cert(ad->pkcs7, trusted_cert,
+                                   ad->verify_iov, VERIFY_IOVCNT);
         X509_free(trusted_cert);
-        if (status == EFI_SUCCESS) {
-            *payload_len_out = payload_len;
-            *payload_out = malloc(payload_len);
-            if (*payload_out)
-                memcpy(*payload_out, payload, payload_len);
-            else
-                status = EFI_DEVICE_ERROR;
-        }
+        return status;
     } else if (auth_type == AUTH_TYPE_PRIVATE) {
-        status = pkcs7_get_signers(sig, sig_len, &pkcs7, &certs);
+        status = auth_desc_top_level_cert(ad, &top_level_cert);
         if (status != EFI_SUCCESS)
-            goto out;
-        if (sk_X509_num(certs) == 0) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
-        top_level_cert = sk_X509_value(certs, sk_X509_num(certs) - 1);
+            return status;
 
-        status = sha256_sig(certs, top_level_cert, digest);
+        status = sha256_sig(ad->signers, top_level_cert, digest);
         if (status != EFI_SUCCESS)
-            goto out;
+            return status;
 
         /*
          * For private authenticated variables, permissive mode means that the
@@ -1061,44 +1388,202 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
          * correctly since it is used for verifying subsequent updates.
          */
         if (auth_enforce && cur &&
-                memcmp(digest, cur->cert, SHA256_DIGEST_SIZE)) {
-            status = EFI_SECURITY_VIOLATION;
-            goto out;
-        }
+                memcmp(digest, cur->cert, SHA256_DIGEST_SIZE))
+            return EFI_SECURITY_VIOLATION;
 
-        status = pkcs7_verify(sig, sig_len, top_level_cert,
-                              verify_buf, verify_len);
-        if (status == EFI_SUCCESS) {
-            *payload_len_out = payload_len;
-            *payload_out = malloc(payload_len);
-            if (*payload_out)
-                memcpy(*payload_out, payload, payload_len);
-            else
-                status = EFI_DEVICE_ERROR;
-        }
+        return pkcs7_verify_cert(ad->pkcs7, top_level_cert,
+                                 ad->verify_iov, VERIFY_IOVCNT);
     } else if (auth_type == AUTH_TYPE_NONE) {
-        status = EFI_SUCCESS;
-        *payload_len_out = payload_len;
-        *payload_out = malloc(payload_len);
-        if (*payload_out)
-            memcpy(*payload_out, payload, payload_len);
-        else
-            status = EFI_DEVICE_ERROR;
-    } else {
-        status = EFI_DEVICE_ERROR;
+        return EFI_SUCCESS;
     }
 
+    return EFI_DEVICE_ERROR;
+}
+
+/*
+ * Results of checking descriptors against PK and KEK, so that replaying the
+ * same signed update (e.g. an OS agent applying the same dbx update at every
+ * boot) costs a hash rather than a PKCS#7 verification. An entry only holds
+ * for the PK and KEK it was computed with, as identified by their generation.
+ */
+#define VERIFY_MEMO_SIZE 64
+
+struct verify_memo {
+    bool valid;
+    uint8_t key[SHA256_DIGEST_SIZE];
+    uint64_t pk_generation;
+    uint64_t kek_generation;
+    EFI_STATUS status;
+};
+
+static struct verify_memo verify_memo[VERIFY_MEMO_SIZE];
+
+static uint64_t
+trust_generation(const uint8_t *name, UINTN name_len)
+{
+    struct efi_variable *var;
+
+    var = varstore_lookup(name, name_len, &gEfiGlobalVariableGuid);
+    return var ? var->generation : 0;
+}
+
+/*
+ * Computes the memo key for checking ad, from data, against auth_types.
+ * Returns false if the result can't be memoized since it depends on more
+ * than PK and KEK.
+ */
+static bool
+verify_memo_key(const struct auth_desc *ad, const uint8_t *data,
+                UINTN data_len, const enum auth_type *auth_types,
+                unsigned int n_types, uint8_t *key)
+{
+    EVP_MD_CTX *ctx;
+    unsigned int i;
+    bool ret;
+
+    for (i = 0; i < n_types; i++)
+        if (auth_types[i] != AUTH_TYPE_PK && auth_types[i] != AUTH_TYPE_KEK)
+            return false;
+
+    ctx = EVP_MD_CTX_create();
+    if (!ctx)
+        return false;
+
+    /* The descriptor holds the timestamp and the signature. */
+    ret = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+          EVP_DigestUpdate(ctx, auth_types, n_types * sizeof(*auth_types)) &&
+          EVP_DigestUpdate(ctx, ad->verify_iov[0].iov_base,
+                           ad->verify_iov[0].iov_len) &&
+          EVP_DigestUpdate(ctx, ad->verify_iov[1].iov_base, GUID_LEN) &&
+          EVP_DigestUpdate(ctx, &ad->verify_attr, sizeof(ad->verify_attr)) &&
+          EVP_DigestUpdate(ctx, data, data_len) &&
+          EVP_DigestFinal_ex(ctx, key, NULL);
+
+    EVP_MD_CTX_destroy(ctx);
+    return ret;
+}
+
+static struct verify_memo *
+verify_memo_slot(const uint8_t *key)
+{
+    return &verify_memo[(key[0] | key[1] << 8) % VERIFY_MEMO_SIZE];
+}
+
+static bool
+verify_memo_lookup(const uint8_t *key, EFI_STATUS *status)
+{
+    struct verify_memo *memo = verify_memo_slot(key);
+
+    if (!memo->valid || memcmp(memo->key, key, SHA256_DIGEST_SIZE) ||
+            memo->pk_generation != trust_generation(EFI_PLATFORM_KEY_NAME,
+                                                    sizeof(EFI_PLATFORM_KEY_NAME)) ||
+            memo->kek_generation != trust_generation(EFI_KEY_EXCHANGE_KEY_NAME,
+                                                     sizeof(EFI_KEY_EXCHANGE_KEY_NAME)))
+        return false;
+
+    *status = memo->status;
+    return true;
+}
+
+static void
+verify_memo_store(const uint8_t *key, EFI_STATUS status)
+{
+    struct verify_memo *memo = verify_memo_slot(key);
+
+    /* Don't remember transient failures. */
+    if (status != EFI_SUCCESS && status != EFI_SECURITY_VIOLATION)
+        return;
+
+    memo->valid = true;
+    memcpy(memo->key, key, SHA256_DIGEST_SIZE);
+    memo->pk_generation = trust_generation(EFI_PLATFORM_KEY_NAME,
+                                           sizeof(EFI_PLATFORM_KEY_NAME));
+    memo->kek_generation = trust_generation(EFI_KEY_EXCHANGE_KEY_NAME,
+                                            sizeof(EFI_KEY_EXCHANGE_KEY_NAME));
+    memo->status = status;
+}
+
+/*
+ * Verify the authentication descriptor for a time based authentication
+ * variable, accepting it if any of the n_types auth_types, tried in order,
+ * does. The descriptor is only parsed once.
+ *
+ * On success, payload_out and payload_len_out refer to the actual payload,
+ * which lies within data.
+ * digest is the digest of the signer's certificates.
+ * timestamp is the associated with the descriptor.
+ */
+static EFI_STATUS
+verify_auth_var_types(uint8_t *name, UINTN name_len,
+                      uint8_t *data, UINTN data_len,
+                      EFI_GUID *guid, UINT32 attr, bool append,
+                      struct efi_variable *cur,
+                      const enum auth_type *auth_types, unsigned int n_types,
+                      uint8_t **payload_out, UINTN *payload_len_out,
+                      uint8_t *digest, EFI_TIME *timestamp)
+{
+    struct auth_desc ad = {0};
+    uint8_t key[SHA256_DIGEST_SIZE];
+    bool is_signed, memoize;
+    EFI_STATUS status;
+    unsigned int i;
+    size_t mark;
+
+    /* Scratch buffers are dropped on return; the payload is within data. */
+    mark = arena_mark(&req_arena);
+
+    is_signed = auth_types[0] != AUTH_TYPE_NONE;
+    status = parse_auth_desc(&ad, name, name_len, data, data_len, guid, attr,
+                             append, cur, is_signed, timestamp);
+    if (status != EFI_SUCCESS)
+        goto out;
+
+    memoize = verify_memo_key(&ad, data, data_len, auth_types, n_types, key);
+    if (memoize && verify_memo_lookup(key, &status))
+        goto done;
+
+    if (is_signed) {
+        status = parse_auth_sig(&ad);
+        if (status != EFI_SUCCESS)
+            goto checked;
+    }
+
+    for (i = 0; i < n_types; i++) {
+        status = check_auth_desc(&ad, auth_types[i], cur, digest);
+        if (status == EFI_SUCCESS)
+            break;
+    }
+
+checked:
+    if (memoize)
+        verify_memo_store(key, status);
+done:
+    if (status == EFI_SUCCESS) {
+        *payload_len_out = ad.payload_len;
+        *payload_out = ad.payload_len ? ad.payload : NULL;
+    }
 out:
-    free(sig);
-    free(var_data);
-    free(tlc_buf);
-    free(verify_buf);
-    sk_X509_free(certs);
-    PKCS7_free(pkcs7);
+    free_auth_desc(&ad);
+    arena_release(&req_arena, mark);
     return status;
 }
 
-static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
+static EFI_STATUS
+verify_auth_var_type(uint8_t *name, UINTN name_len,
+                     uint8_t *data, UINTN data_len,
+                     EFI_GUID *guid, UINT32 attr, bool append,
+                     struct efi_variable *cur, enum auth_type auth_type,
+                     uint8_t **payload_out, UINTN *payload_len_out,
+                     uint8_t *digest, EFI_TIME *timestamp)
+{
+    return verify_auth_var_types(name, name_len, data, data_len, guid, attr,
+                                 append, cur, &auth_type, 1,
+                                 payload_out, payload_len_out,
+                                 digest, timestamp);
+}
+
+static EFI_STATUS verify_auth_var(enum var_kind kind,
+                                  uint8_t *name, UINTN name_len,
                                   uint8_t *data, UINTN data_len,
                                   EFI_GUID *guid, UINT32 attr, bool append,
                                   struct efi_variable *cur,
@@ -1106,23 +1591,20 @@ static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
                                   uint8_t *digest, EFI_TIME *timestamp)
 {
     EFI_STATUS status;
-    uint8_t *var;
+    const uint8_t *var;
     uint8_t setup_mode, secure_boot;
     UINTN var_len;
 
     *payload_out = NULL;
 
-    status = internal_get_variable(EFI_SETUP_MODE_NAME,
-                                   sizeof(EFI_SETUP_MODE_NAME),
-                                   &gEfiGlobalVariableGuid, &var, &var_len);
+    status = internal_view_variable(EFI_SETUP_MODE_NAME,
+                                    sizeof(EFI_SETUP_MODE_NAME),
+                                    &gEfiGlobalVariableGuid, &var, &var_len);
     if (status != EFI_SUCCESS)
         return status;
     setup_mode = var[0];
-    free(var);
 
-    if (name_len == sizeof(EFI_PLATFORM_KEY_NAME) &&
-            !memcmp(name, EFI_PLATFORM_KEY_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) {
+    if (kind == VAR_KIND_PK) {
         enum auth_type type = AUTH_TYPE_PK;
 
         /*
@@ -1230,9 +1712,7 @@ static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
             if (saved_status != EFI_SUCCESS)
                 status = saved_status;
         }
-    } else if (name_len == sizeof(EFI_KEY_EXCHANGE_KEY_NAME) &&
-               !memcmp(name, EFI_KEY_EXCHANGE_KEY_NAME, name_len) &&
-               !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) {
+    } else if (kind == VAR_KIND_KEK) {
         enum auth_type type = AUTH_TYPE_PK;
 
         if (setup_mode == 1 || !auth_enforce)
@@ -1247,13 +1727,7 @@ static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
         if (status == EFI_SUCCESS)
             status = check_signature_list_format(*payload_out, *payload_len_out,
                                                  false);
-    } else if (!memcmp(guid, &gEfiImageSecurityDatabaseGuid, GUID_LEN) &&
-               ((name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE, name_len)) ||
-                (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE1) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE1, name_len)) ||
-                (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE2) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE2, name_len)))) {
+    } else if (kind == VAR_KIND_DB) {
         if (setup_mode == 1 || !auth_enforce) {
             status = verify_auth_var_type(name, name_len,
                                           data, data_len,
@@ -1262,19 +1736,16 @@ static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
                                           payload_out, payload_len_out,
                                           digest, timestamp);
         } else {
-            status = verify_auth_var_type(name, name_len,
-                                          data, data_len,
-                                          guid, attr, append,
-                                          cur, AUTH_TYPE_PK,
-                                          payload_out, payload_len_out,
-                                          digest, timestamp);
-            if (status != EFI_SUCCESS)
-                status = verify_auth_var_type(name, name_len,
-                                              data, data_len,
-                                              guid, attr, append,
-                                              cur, AUTH_TYPE_KEK,
-                                              payload_out, payload_len_out,
-                                              digest, timestamp);
+            static const enum auth_type types[] = {
+                AUTH_TYPE_PK, AUTH_TYPE_KEK,
+            };
+
+            status = verify_auth_var_types(name, name_len,
+                                           data, data_len,
+                                           guid, attr, append,
+                                           cur, types, ARRAY_SIZE(types),
+                                           payload_out, payload_len_out,
+                                           digest, timestamp);
         }
 
         if (status == EFI_SUCCESS)
@@ -1291,16 +1762,14 @@ static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
 
 out:
     if (status != EFI_SUCCESS)
-        free(*payload_out);
+        *payload_out = NULL;
     return status;
 }
 
 static EFI_STATUS
-check_ppi_variables(uint8_t *name, UINTN name_len, EFI_GUID *guid, uint8_t *data, UINTN data_len)
+check_ppi_variables(enum var_kind kind, uint8_t *data, UINTN data_len)
 {
-    if (name_len == sizeof(TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME) &&
-            !memcmp(name, TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME, name_len) &&
-            !memcmp(guid, &gEfiTcg2PpiXenGuid, GUID_LEN)) {
+    if (kind == VAR_KIND_PPI_FLAGS_LOCK) {
        if (data_len != sizeof (uint8_t)) {
            DBG("Bad PPI lock write. size=%lu\n", data_len);
            return EFI_INVALID_PARAMETER;
@@ -1313,26 +1782,22 @@ check_ppi_variables(uint8_t *name, UINTN name_len, EFI_GUID *guid, uint8_t *data
        return EFI_SUCCESS;
     }
 
-    if ((name_len == sizeof(TCG2_PHYSICAL_PRESENCEFLAGS_NAME) &&
-            !memcmp(name, TCG2_PHYSICAL_PRESENCEFLAGS_NAME, name_len)) &&
-            !memcmp(guid, &gEfiTcg2PpiXenGuid, GUID_LEN)) {
+    if (kind == VAR_KIND_PPI_FLAGS) {
 
         EFI_STATUS status;
         UINTN lock_len;
-        uint8_t *lock_data;
+        const uint8_t *lock_data;
 
-        status = internal_get_variable(TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME,
-                                       sizeof(TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME),
-                                       &gEfiTcg2PpiXenGuid, &lock_data, &lock_len);
+        status = internal_view_variable(TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME,
+                                        sizeof(TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME),
+                                        &gEfiTcg2PpiXenGuid, &lock_data, &lock_len);
         if (status == EFI_SUCCESS) {
 
             if (lock_len != sizeof(uint8_t) ||
                 *lock_data != 0) {
                 DBG("Attempt to set PPI flags while locked! Lock length %lu, value: %hu \n", lock_len, lock_len ? *lock_data : 0xff);
-                free(lock_data);
                 return EFI_WRITE_PROTECTED;
             }
-            free(lock_data);
         } else {
            DBG("Attempt to set PPI flags while, but getting lock returned 0x%016lx\n", status);
            return status;
@@ -1342,69 +1807,276 @@ check_ppi_variables(uint8_t *name, UINTN name_len, EFI_GUID *guid, uint8_t *data
 }
 
 static bool
-check_ro_variable(uint8_t *name, UINTN name_len, EFI_GUID *guid)
-{
-    if ((name_len == sizeof(EFI_AUDIT_MODE_NAME) &&
-            !memcmp(name, EFI_AUDIT_MODE_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_DEPLOYED_MODE_NAME) &&
-            !memcmp(name, EFI_DEPLOYED_MODE_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_SECURE_BOOT_MODE_NAME) &&
-            !memcmp(name, EFI_SECURE_BOOT_MODE_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_SETUP_MODE_NAME) &&
-            !memcmp(name, EFI_SETUP_MODE_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_SIGNATURE_SUPPORT_NAME) &&
-            !memcmp(name, EFI_SIGNATURE_SUPPORT_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)))
-        return true;
-    return false;
+check_attr(enum var_kind kind, UINT32 attr)
+{
+    switch (kind) {
+    case VAR_KIND_PK:
+    case VAR_KIND_KEK:
+    case VAR_KIND_DB:
+        return attr != (ATTR_BRNV | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS);
+    default:
+        return false;
+    }
 }
 
-static bool
-check_attr(uint8_t *name, UINTN name_len, EFI_GUID *guid, UINT32 attr)
-{
-    if ((name_len == sizeof(EFI_PLATFORM_KEY_NAME) &&
-            !memcmp(name, EFI_PLATFORM_KEY_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_KEY_EXCHANGE_KEY_NAME) &&
-            !memcmp(name, EFI_KEY_EXCHANGE_KEY_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN))) {
-        if (attr != (ATTR_BRNV | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS))
-            return true;
-    } else if (!memcmp(guid, &gEfiImageSecurityDatabaseGuid, GUID_LEN) &&
-               ((name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE, name_len)) ||
-                (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE1) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE1, name_len)) ||
-                (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE2) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE2, name_len)))) {
-        if (attr != (ATTR_BRNV | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS))
-            return true;
+/*
+ * Hash set of the entries of a signature database variable, so that
+ * deduplicating an append costs a lookup per new entry rather than a scan of
+ * the variable. Entries are referred to by offset since the variable's data
+ * may move. The index is valid for the generation of the variable it was
+ * last brought up to date with; appended entries are added to it, any other
+ * change means it is rebuilt.
+ */
+struct sig_slot {
+    uint32_t hash;
+    uint32_t list; /* Offset of the EFI_SIGNATURE_LIST */
+    uint32_t entry; /* Offset of the EFI_SIGNATURE_DATA, 0 if the slot is free */
+};
+
+struct sig_index {
+    uint64_t generation; /* 0 when empty */
+    struct sig_slot *slots;
+    uint32_t mask;
+    uint32_t count;
+};
+
+static struct {
+    const uint8_t *name;
+    UINTN name_len;
+    struct sig_index index;
+} sig_indexes[] = {
+    {EFI_IMAGE_SECURITY_DATABASE, sizeof(EFI_IMAGE_SECURITY_DATABASE)},
+    {EFI_IMAGE_SECURITY_DATABASE1, sizeof(EFI_IMAGE_SECURITY_DATABASE1)},
+    {EFI_IMAGE_SECURITY_DATABASE2, sizeof(EFI_IMAGE_SECURITY_DATABASE2)},
+};
+
+/* Returns the index kept for var, or NULL if it isn't db, dbx or dbt. */
+static struct sig_index *
+sig_index_of(const struct efi_variable *var)
+{
+    size_t i;
+
+    if (memcmp(&var->guid, &gEfiImageSecurityDatabaseGuid, GUID_LEN))
+        return NULL;
+
+    for (i = 0; i < ARRAY_SIZE(sig_indexes); i++) {
+        if (sig_indexes[i].name_len == var->name_len &&
+                !memcmp(sig_indexes[i].name, var->name, var->name_len))
+            return &sig_indexes[i].index;
     }
 
-    return false;
+    return NULL;
+}
+
+static void
+sig_index_clear(struct sig_index *si)
+{
+    free(si->slots);
+    si->slots = NULL;
+    si->mask = 0;
+    si->count = 0;
+    si->generation = 0;
+}
+
+/* FNV-1a over the signature type and entry, which determine its size. */
+static uint32_t
+sig_hash(const EFI_SIGNATURE_LIST *list, const EFI_SIGNATURE_DATA *entry)
+{
+    const uint8_t *ptr;
+    uint32_t hash = 2166136261u;
+    UINTN i;
+
+    ptr = (const uint8_t *)&list->SignatureType;
+    for (i = 0; i < GUID_LEN; i++)
+        hash = (hash ^ ptr[i]) * 16777619u;
+    ptr = (const uint8_t *)entry;
+    for (i = 0; i < list->SignatureSize; i++)
+        hash = (hash ^ ptr[i]) * 16777619u;
+
+    return hash;
+}
+
+/* Returns the slot holding entry, or the free slot where it would go. */
+static struct sig_slot *
+sig_index_find(const struct sig_index *si, const uint8_t *data,
+               const EFI_SIGNATURE_LIST *list, const EFI_SIGNATURE_DATA *entry,
+               uint32_t hash)
+{
+    const EFI_SIGNATURE_LIST *old_list;
+    struct sig_slot *slot;
+    uint32_t i;
+
+    for (i = hash & si->mask; ; i = (i + 1) & si->mask) {
+        slot = &si->slots[i];
+        if (!slot->entry)
+            return slot;
+        if (slot->hash != hash)
+            continue;
+
+        old_list = (const EFI_SIGNATURE_LIST *)(data + slot->list);
+        if (old_list->SignatureSize == list->SignatureSize &&
+                !memcmp(&old_list->SignatureType, &list->SignatureType,
+                        GUID_LEN) &&
+                !memcmp(data + slot->entry, entry, list->SignatureSize))
+            return slot;
+    }
+}
+
+/* Makes room for n more entries, keeping the table at most half full. */
+static EFI_STATUS
+sig_index_reserve(struct sig_index *si, UINTN n)
+{
+    struct sig_slot *slots, *slot;
+    UINTN size, old_size, i;
+    uint32_t mask, j;
+
+    old_size = si->slots ? (UINTN)si->mask + 1 : 0;
+    for (size = old_size ? old_size : 16; size < (si->count + n) * 2; size *= 2)
+        ;
+    if (size == old_size)
+        return EFI_SUCCESS;
+
+    slots = calloc(size, sizeof(*slots));
+    if (!slots)
+        return EFI_DEVICE_ERROR;
+    mask = size - 1;
+
+    /* The entries are distinct so only a free slot needs to be found. */
+    for (i = 0; i < old_size; i++) {
+        slot = &si->slots[i];
+        if (!slot->entry)
+            continue;
+        for (j = slot->hash & mask; slots[j].entry; j = (j + 1) & mask)
+            ;
+        slots[j] = *slot;
+    }
+
+    free(si->slots);
+    si->slots = slots;
+    si->mask = mask;
+
+    return EFI_SUCCESS;
 }
 
 /*
- * Append a signature list, new_data, to an existing signature list, data,
+ * Adds the entries of the signature lists between offsets start and end of
+ * data, which must be a valid signature database.
+ */
+static EFI_STATUS
+sig_index_add(struct sig_index *si, const uint8_t *data,
+              UINTN start, UINTN end)
+{
+    const EFI_SIGNATURE_LIST *cert_list;
+    const EFI_SIGNATURE_DATA *cert;
+    struct sig_slot *slot;
+    EFI_STATUS status;
+    UINTN rem;
+    uint32_t hash;
+    int i, cert_count;
+
+    /* Each entry is at least EFI_SIG_DATA_SIZE bytes. */
+    status = sig_index_reserve(si, (end - start) / EFI_SIG_DATA_SIZE);
+    if (status != EFI_SUCCESS)
+        return status;
+
+    rem = end - start;
+    cert_list = (const EFI_SIGNATURE_LIST *)(data + start);
+    while ((rem > 0) && (rem >= cert_list->SignatureListSize)) {
+        cert = (const EFI_SIGNATURE_DATA *)((const uint8_t *)cert_list +
+               sizeof(EFI_SIGNATURE_LIST) + cert_list->SignatureHeaderSize);
+        cert_count = (cert_list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
+                      cert_list->SignatureHeaderSize) / cert_list->SignatureSize;
+
+        for (i = 0; i < cert_count; i++) {
+            hash = sig_hash(cert_list, cert);
+            slot = sig_index_find(si, data, cert_list, cert, hash);
+            if (!slot->entry) {
+                slot->hash = hash;
+                slot->list = (const uint8_t *)cert_list - data;
+                slot->entry = (const uint8_t *)cert - data;
+                si->count++;
+            }
+            cert = (const EFI_SIGNATURE_DATA *)((const uint8_t *)cert +
+                   cert_list->SignatureSize);
+        }
+
+        rem -= cert_list->SignatureListSize;
+        cert_list = (const EFI_SIGNATURE_LIST *)((const uint8_t *)cert_list +
+                    cert_list->SignatureListSize);
+    }
+
+    return EFI_SUCCESS;
+}
+
+/* Brings the index of var up to date. var must hold a valid database. */
+static EFI_STATUS
+sig_index_get(struct sig_index *si, const struct efi_variable *var)
+{
+    EFI_STATUS status;
+
+    if (si->generation == var->generation)
+        return EFI_SUCCESS;
+
+    sig_index_clear(si);
+    status = sig_index_add(si, var->data, 0, var->data_len);
+    if (status != EFI_SUCCESS) {
+        sig_index_clear(si);
+        return status;
+    }
+
+    si->generation = var->generation;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Called after filtered entries were appended to var, which had generation
+ * old_generation and old_len bytes of data before, to add them to its index.
+ */
+static void
+sig_index_appended(const struct efi_variable *var, uint64_t old_generation,
+                   UINTN old_len)
+{
+    struct sig_index *si = sig_index_of(var);
+
+    if (!si || si->generation != old_generation)
+        return;
+
+    if (sig_index_add(si, var->data, old_len, var->data_len) != EFI_SUCCESS) {
+        sig_index_clear(si);
+        return;
+    }
+
+    si->generation = var->generation;
+}
+
+/*
+ * Append a signature list, new_data, to the existing signature list of var,
  * while removing duplicates. This function must only be called with valid
  * signature lists (i.e. check_signature_list_format has already been called
  * on the signature list).
  */
 static EFI_STATUS
-filter_signature_list(uint8_t *data, UINTN data_len,
+filter_signature_list(const struct efi_variable *var,
                       uint8_t *new_data, UINTN *new_data_len)
 {
-    EFI_SIGNATURE_LIST *cert_list, *new_cert_list, *old_cert_list;
-    EFI_SIGNATURE_DATA *new_cert, *old_cert;
-    UINTN new_rem, old_rem;
+    EFI_SIGNATURE_LIST *cert_list, *new_cert_list;
+    EFI_SIGNATURE_DATA *new_cert;
+    struct sig_index *si;
+    struct sig_slot *slot;
+    EFI_STATUS status;
+    UINTN new_rem;
     uint8_t *buf, *ptr;
-    int i, j, new_cert_count, old_cert_count;
+    int i, new_cert_count;
+
+    si = sig_index_of(var);
+    if (!si)
+        return EFI_DEVICE_ERROR;
 
-    buf = malloc(*new_data_len);
+    status = sig_index_get(si, var);
+    if (status != EFI_SUCCESS)
+        return status;
+
+    buf = arena_alloc(&req_arena, *new_data_len);
     if (!buf)
         return EFI_DEVICE_ERROR;
     ptr = buf;
@@ -1421,35 +2093,9 @@ filter_signature_list(uint8_t *data, UINTN data_len,
                           new_cert_list->SignatureHeaderSize) / new_cert_list->SignatureSize;
 
         for (i = 0; i < new_cert_count; i++) {
-            bool is_new_cert = true;
-
-            old_rem = data_len;
-            old_cert_list = (EFI_SIGNATURE_LIST *)data;
-            while ((old_rem > 0) && (old_rem >= old_cert_list->SignatureListSize)) {
-                if (!memcmp(&old_cert_list->SignatureType, &new_cert_list->SignatureType, GUID_LEN) &&
-                        (old_cert_list->SignatureSize == new_cert_list->SignatureSize)) {
-                    old_cert = (EFI_SIGNATURE_DATA *)((uint8_t *)old_cert_list +
-                               sizeof(EFI_SIGNATURE_LIST) + old_cert_list->SignatureHeaderSize);
-                    old_cert_count = (old_cert_list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
-                                      old_cert_list->SignatureHeaderSize) / old_cert_list->SignatureSize;
-
-                    for (j = 0; j < old_cert_count; j++) {
-                        if (!memcmp(new_cert, old_cert, old_cert_list->SignatureSize)) {
-                            is_new_cert = false;
-                            break;
-                        }
-                        old_cert = (EFI_SIGNATURE_DATA *)((uint8_t *)old_cert + old_cert_list->SignatureSize);
-                    }
-                }
-                if (!is_new_cert)
-                    break;
-
-                old_rem -= old_cert_list->SignatureListSize;
-                old_cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)old_cert_list +
-                                old_cert_list->SignatureListSize);
-            }
-
-            if (is_new_cert) {
+            slot = sig_index_find(si, var->data, new_cert_list,
+                                  new_cert, sig_hash(new_cert_list, new_cert));
+            if (!slot->entry) {
                 if (copied == 0) {
                     memcpy(ptr, new_cert_list,
                            sizeof(EFI_SIGNATURE_LIST) + new_cert_list->SignatureHeaderSize);
@@ -1469,87 +2115,18 @@ filter_signature_list(uint8_t *data, UINTN data_len,
             int size = sizeof(EFI_SIGNATURE_LIST) + new_cert_list->SignatureHeaderSize +
                        (copied * new_cert_list->SignatureSize);
             cert_list = (EFI_SIGNATURE_LIST *)(ptr - size);
-            cert_list->SignatureListSize = size;
-        }
-
-        new_rem -= new_cert_list->SignatureListSize;
-        new_cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)new_cert_list +
-                        new_cert_list->SignatureListSize);
-    }
-
-    *new_data_len = ptr - buf;
-    memcpy(new_data, buf, *new_data_len);
-    free(buf);
-
-    return EFI_SUCCESS;
-}
-
-static struct efi_variable *
-copy_efi_variable(struct efi_variable *efi_var)
-{
-    struct efi_variable *new_efi_var;
-
-    if (efi_var == NULL)
-        return NULL;
-
-    new_efi_var = malloc(sizeof *new_efi_var);
-    if (!new_efi_var)
-        return NULL;
-
-    *new_efi_var = *efi_var;
-    new_efi_var->next = NULL;
-
-    new_efi_var->name = malloc(efi_var->name_len);
-    if (!new_efi_var->name) {
-        free(new_efi_var);
-        return NULL;
-    }
-    memcpy(new_efi_var->name, efi_var->name, efi_var->name_len);
-
-    new_efi_var->data = malloc(efi_var->data_len);
-    if (!new_efi_var->data) {
-        free(new_efi_var->name);
-        free(new_efi_var);
-        return NULL;
-    }
-    memcpy(new_efi_var->data, efi_var->data, efi_var->data_len);
-
-    return new_efi_var;
-}
-
-static void
-free_efi_variable(struct efi_variable *efi_var)
-{
-    if (efi_var == NULL)
-        return;
+            cert_list->SignatureListSize = size;
+        }
 
-    free(efi_var->name);
-    free(efi_var->data);
-    free(efi_var);
-}
+        new_rem -= new_cert_list->SignatureListSize;
+        new_cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)new_cert_list +
+                        new_cert_list->SignatureListSize);
+    }
 
-/* Returns true if two EFI variables are equivalent, false otherwise. */
-static bool
-cmp_efi_variable(struct efi_variable *a, struct efi_variable *b)
-{
-    if (a->name_len != b->name_len)
-        return false;
-    if (a->data_len != b->data_len)
-        return false;
-    if (a->attributes != b->attributes)
-        return false;
-    if (memcmp(&a->guid, &b->guid, GUID_LEN))
-        return false;
-    if (memcmp(&a->timestamp, &b->timestamp, sizeof(a->timestamp)))
-        return false;
-    if (memcmp(a->cert, b->cert, sizeof(a->cert)))
-        return false;
-    if (memcmp(a->name, b->name, a->name_len))
-        return false;
-    if (memcmp(a->data, b->data, a->data_len))
-        return false;
+    *new_data_len = ptr - buf;
+    memcpy(new_data, buf, *new_data_len);
 
-    return true;
+    return EFI_SUCCESS;
 }
 
 #if 0
@@ -1573,28 +2150,29 @@ static void
 do_set_variable(uint8_t *comm_buf)
 {
     UINTN name_len, data_len;
-    struct efi_variable *l, *prev = NULL;
+    struct efi_variable *l;
     uint8_t *ptr, *name, *data;
     EFI_GUID guid;
     UINT32 attr;
     BOOLEAN at_runtime, append;
     EFI_STATUS status;
+    enum var_kind kind;
+    size_t mark;
     uint8_t digest[SHA256_DIGEST_SIZE] = {0};
     EFI_TIME timestamp;
 
     ptr = comm_buf;
     unserialize_uint32(&ptr); /* version */
     unserialize_command(&ptr);
-    name = unserialize_data(&ptr, &name_len, NAME_LIMIT);
+    name = unserialize_data_arena(&ptr, &name_len, NAME_LIMIT, &req_arena);
     if (!name) {
         serialize_result(&comm_buf, name_len == 0 ? EFI_INVALID_PARAMETER : EFI_DEVICE_ERROR);
         return;
     }
     unserialize_guid(&ptr, &guid);
-    data = unserialize_data(&ptr, &data_len, DATA_LIMIT);
+    data = unserialize_data_arena(&ptr, &data_len, DATA_LIMIT, &req_arena);
     if (!data && data_len) {
         serialize_result(&comm_buf, data_len > DATA_LIMIT ? EFI_OUT_OF_RESOURCES : EFI_DEVICE_ERROR);
-        free(name);
         return;
     }
     attr = unserialize_uint32(&ptr);
@@ -1607,234 +2185,197 @@ do_set_variable(uint8_t *comm_buf)
     /* The hardware error record is not supported for now. */
     if (attr & EFI_VARIABLE_HARDWARE_ERROR_RECORD) {
         serialize_result(&ptr, EFI_INVALID_PARAMETER);
-        goto err;
+        return;
     }
 
     /* Authenticated write access is deprecated and is not supported. */
     if (attr & EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS) {
         serialize_result(&ptr, EFI_UNSUPPORTED);
-        goto err;
+        return;
     }
 
     if ((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
             (attr & EFI_VARIABLE_ENHANCED_AUTHENTICATED_ACCESS)) {
         serialize_result(&ptr, EFI_INVALID_PARAMETER);
-        goto err;
+        return;
     }
 
     /* Enhanced authenticated access is not yet implemented. */
     if (attr & EFI_VARIABLE_ENHANCED_AUTHENTICATED_ACCESS) {
         serialize_result(&ptr, EFI_UNSUPPORTED);
-        goto err;
+        return;
     }
 
     /* If runtime access is set, bootservice access must also be set. */
     if ((attr & (EFI_VARIABLE_RUNTIME_ACCESS |
                EFI_VARIABLE_BOOTSERVICE_ACCESS)) == EFI_VARIABLE_RUNTIME_ACCESS) {
         serialize_result(&ptr, EFI_INVALID_PARAMETER);
-        goto err;
+        return;
     }
 
-    if (is_mor_control(name, name_len, &guid)) {
+    kind = classify_variable(name, name_len, &guid);
+
+    if (kind == VAR_KIND_MOR_CONTROL) {
         serialize_result(&ptr, do_set_mor_control(data, data_len, attr, append));
-        goto err;
+        return;
     }
 
-    if (is_mor_control_lock(name, name_len, &guid)) {
+    if (kind == VAR_KIND_MOR_CONTROL_LOCK) {
         serialize_result(&ptr, do_set_mor_control_lock(data, data_len, attr, append));
-        goto err;
+        return;
     }
 
-    l = var_list;
-    while (l) {
-        if (l->name_len == name_len &&
-                !memcmp(l->name, name, name_len) &&
-                !memcmp(&l->guid, &guid, GUID_LEN)) {
-            struct efi_variable *rollback_var = NULL;
-            bool should_save = !!(l->attributes & EFI_VARIABLE_NON_VOLATILE);
+    /*
+     * Changes to the variable and to any internal variables it affects
+     * (e.g. SetupMode on a PK write) are made in one transaction so that
+     * they are undone together and saved with a single backend flush.
+     */
+    mark = varstore_begin();
 
-            /* Only runtime variables can be updated/deleted at runtime. */
-            if (at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS)) {
-                serialize_result(&ptr, EFI_INVALID_PARAMETER);
-                goto err;
-            }
+    l = varstore_lookup(name, name_len, &guid);
+    if (l) {
+        /* Only runtime variables can be updated/deleted at runtime. */
+        if (at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS)) {
+            serialize_result(&ptr, EFI_INVALID_PARAMETER);
+            goto abort;
+        }
 
-            /* Only NV variables can be update/deleted at runtime. */
-            if (at_runtime && !(l->attributes & EFI_VARIABLE_NON_VOLATILE)) {
-                serialize_result(&ptr, EFI_WRITE_PROTECTED);
-                goto err;
-            }
+        /* Only NV variables can be update/deleted at runtime. */
+        if (at_runtime && !(l->attributes & EFI_VARIABLE_NON_VOLATILE)) {
+            serialize_result(&ptr, EFI_WRITE_PROTECTED);
+            goto abort;
+        }
+
+        if (kind == VAR_KIND_READ_ONLY) {
+            serialize_result(&ptr, EFI_WRITE_PROTECTED);
+            goto abort;
+        }
 
-            if (check_ro_variable(name, name_len, &guid)) {
-                serialize_result(&ptr, EFI_WRITE_PROTECTED);
-                goto err;
+        status = check_ppi_variables(kind, data, data_len);
+        if (status != EFI_SUCCESS) {
+            serialize_result(&ptr, status);
+            goto abort;
+        }
+        if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
+            uint8_t *payload;
+            UINTN payload_len;
+
+            /*
+             * Authenticated variables cannot be deleted by setting no
+             * access bits so ensure the bits are unchanged early.
+             */
+            if (l->attributes != attr) {
+                serialize_result(&ptr, EFI_INVALID_PARAMETER);
+                goto abort;
             }
 
-            status = check_ppi_variables(name, name_len, &guid, data, data_len);
+            status = verify_auth_var(kind, name, name_len,
+                                     data, data_len,
+                                     &guid, attr, append,
+                                     l,
+                                     &payload, &payload_len,
+                                     digest, &timestamp);
             if (status != EFI_SUCCESS) {
                 serialize_result(&ptr, status);
-                goto err;
+                goto abort;
             }
-            if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
-                uint8_t *payload;
-                UINTN payload_len;
-
-                /*
-                 * Authenticated variables cannot be deleted by setting no
-                 * access bits so ensure the bits are unchanged early.
-                 */
-                if (l->attributes != attr) {
-                    serialize_result(&ptr, EFI_INVALID_PARAMETER);
-                    goto err;
-                }
+            data = payload;
+            data_len = payload_len;
+        }
 
-                status = verify_auth_var(name, name_len,
-                                         data, data_len,
-                                         &guid, attr, append,
-                                         l,
-                                         &payload, &payload_len,
-                                         digest, &timestamp);
-                if (status != EFI_SUCCESS) {
-                    serialize_result(&ptr, status);
-                    goto err;
-                }
-                free(data);
-                data = payload;
-                data_len = payload_len;
+        if ((data_len == 0 && !append) || !(attr & ATTR_BR)) {
+            /*
+             * Authenticated variables cannot be deleted by unsetting
+             * attributes. (2.7A page 248)
+             */
+            if ((l->attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+                (l->attributes != attr)) {
+                serialize_result(&ptr, EFI_INVALID_PARAMETER);
+                goto abort;
             }
 
-            if ((data_len == 0 && !append) || !(attr & ATTR_BR)) {
-                /*
-                 * Authenticated variables cannot be deleted by unsetting
-                 * attributes. (2.7A page 248)
-                 */
-                if ((l->attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
-                    (l->attributes != attr)) {
-                    serialize_result(&ptr, EFI_INVALID_PARAMETER);
-                    goto err;
+            if (!varstore_remove(l)) {
+                serialize_result(&ptr, EFI_DEVICE_ERROR);
+                goto abort;
+            }
+        } else {
+            if (l->attributes != attr) {
+                serialize_result(&ptr, EFI_INVALID_PARAMETER);
+                goto abort;
+            }
+            if (append) {
+                bool sig_db = (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+                              kind == VAR_KIND_DB;
+                uint64_t old_generation = l->generation;
+                UINTN old_len = l->data_len;
+
+                if (sig_db) {
+                    status = filter_signature_list(l, data, &data_len);
+                    if (status != EFI_SUCCESS) {
+                        serialize_result(&ptr, status);
+                        goto abort;
+                    }
                 }
 
-                if (prev)
-                    prev->next = l->next;
-                else
-                    var_list = l->next;
-                rollback_var = l;
-                free(data);
-            } else {
-                if (l->attributes != attr) {
-                    serialize_result(&ptr, EFI_INVALID_PARAMETER);
-                    goto err;
+                if (varstore_total_usage() + data_len > TOTAL_LIMIT) {
+                    serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+                    goto abort;
                 }
-                if (append) {
-                    uint8_t *new_data;
-
-                    if ((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
-                            !memcmp(&guid, &gEfiImageSecurityDatabaseGuid, GUID_LEN) &&
-                            ((name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE) &&
-                              !memcmp(name, EFI_IMAGE_SECURITY_DATABASE, name_len)) ||
-                             (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE1) &&
-                              !memcmp(name, EFI_IMAGE_SECURITY_DATABASE1, name_len)) ||
-                             (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE2) &&
-                              !memcmp(name, EFI_IMAGE_SECURITY_DATABASE2, name_len)))) {
-                        status = filter_signature_list(l->data, l->data_len, data, &data_len);
-                        if (status != EFI_SUCCESS) {
-                            serialize_result(&ptr, status);
-                            goto err;
-                        }
-                    }
-
-                    if (get_space_usage() + data_len > TOTAL_LIMIT) {
-                        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
-                        goto err;
-                    }
-
-                    rollback_var = copy_efi_variable(l);
-                    if (!rollback_var) {
-                        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
-                        goto err;
-                    }
-
-                    new_data = realloc(l->data, l->data_len + data_len);
-                    if (!new_data) {
-                        serialize_result(&ptr, EFI_DEVICE_ERROR);
-                        free_efi_variable(rollback_var);
-                        goto err;
-                    }
-                    if ((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
-                            time_later(&l->timestamp, &timestamp))
-                        l->timestamp = timestamp;
-                    l->data = new_data;
-                    memcpy(l->data + l->data_len, data, data_len);
-                    free(data);
-                    l->data_len += data_len;
-                } else {
-                    if (get_space_usage() - l->data_len + data_len > TOTAL_LIMIT) {
-                        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
-                        goto err;
-                    }
 
-                    rollback_var = copy_efi_variable(l);
-                    if (!rollback_var) {
-                        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
-                        goto err;
-                    }
-
-                    if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS)
-                        l->timestamp = timestamp;
-                    free(l->data);
-                    l->data = data;
-                    l->data_len = data_len;
+                if (!varstore_append_data(l, data, data_len)) {
+                    serialize_result(&ptr, EFI_DEVICE_ERROR);
+                    goto abort;
+                }
+                if (sig_db)
+                    sig_index_appended(l, old_generation, old_len);
+                if ((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+                        time_later(&l->timestamp, &timestamp))
+                    l->timestamp = timestamp;
+            } else {
+                if (varstore_total_usage() - l->data_len + data_len > TOTAL_LIMIT) {
+                    serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+                    goto abort;
                 }
 
-                /* Skip saving if nothing changed. */
-                if (cmp_efi_variable(l, rollback_var))
-                    should_save = false;
-            }
-            free(name);
-            if (should_save && persistent) {
-                if (!db->set_variable()) {
-                    /* efivar delete and append/update case */
-                    rollback_var->next = l->next;
-                    if (prev)
-                        prev->next = rollback_var;
-                    else
-                        var_list = rollback_var;
-
-                    /* Free the changed var in the append/update case */
-                    if (rollback_var != l)
-                        free_efi_variable(l);
+                if (!varstore_set_data(l, data, data_len)) {
                     serialize_result(&ptr, EFI_DEVICE_ERROR);
-                    return;
+                    goto abort;
                 }
+                if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS)
+                    l->timestamp = timestamp;
             }
-            free_efi_variable(rollback_var);
-            serialize_result(&ptr, EFI_SUCCESS);
+        }
+        /* The backend is only flushed if an NV variable changed. */
+        if (!varstore_commit(persistent ? db->set_variable : NULL)) {
+            serialize_result(&ptr, EFI_DEVICE_ERROR);
             return;
         }
-        prev = l;
-        l = l->next;
+        /* Deletes and updates may leave slabs sparsely used. */
+        varstore_compact();
+        serialize_result(&ptr, EFI_SUCCESS);
+        return;
     }
 
     if (data_len == 0 || !(attr & ATTR_BR)) {
         serialize_result(&ptr, EFI_NOT_FOUND);
-        goto err;
+        goto abort;
     } else {
         if (at_runtime && (!(attr & EFI_VARIABLE_RUNTIME_ACCESS) ||
                            !(attr & EFI_VARIABLE_NON_VOLATILE))) {
             serialize_result(&ptr, EFI_INVALID_PARAMETER);
-            goto err;
+            goto abort;
         }
 
-        if (check_attr(name, name_len, &guid, attr)) {
+        if (check_attr(kind, attr)) {
             serialize_result(&ptr, EFI_INVALID_PARAMETER);
-            goto err;
+            goto abort;
         }
 
         if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
             uint8_t *payload;
             UINTN payload_len;
 
-            status = verify_auth_var(name, name_len,
+            status = verify_auth_var(kind, name, name_len,
                                      data, data_len,
                                      &guid, attr, append,
                                      NULL,
@@ -1842,60 +2383,51 @@ do_set_variable(uint8_t *comm_buf)
                                      digest, &timestamp);
             if (status != EFI_SUCCESS) {
                 serialize_result(&ptr, status);
-                goto err;
+                goto abort;
             }
-            free(data);
             data = payload;
             data_len = payload_len;
         }
 
         if (data_len == 0) {
             serialize_result(&ptr, EFI_NOT_FOUND);
-            goto err;
+            goto abort;
         }
 
-        if (get_space_usage() + name_len + data_len +
+        if (varstore_total_usage() + name_len + data_len +
                 VARIABLE_SIZE_OVERHEAD > TOTAL_LIMIT) {
             serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
-            goto err;
+            goto abort;
         }
 
-        l = calloc(1, sizeof(*l));
+        l = varstore_new(name, name_len, &guid, data, data_len);
         if (!l) {
             serialize_result(&ptr, EFI_DEVICE_ERROR);
-            goto err;
+            goto abort;
         }
 
-        l->name = name;
-        l->name_len = name_len;
-        memcpy(&l->guid, &guid, GUID_LEN);
-        l->data = data;
-        l->data_len = data_len;
         l->attributes = attr;
         if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
             l->timestamp = timestamp;
             memcpy(l->cert, digest, SHA256_DIGEST_SIZE);
         }
-        l->next = var_list;
-        var_list = l;
-        if ((attr & EFI_VARIABLE_NON_VOLATILE) && persistent) {
-            if (!db->set_variable()) {
-                /* remove var inserted to head */
-                var_list = l->next;
-
-                free_efi_variable(l);
-                serialize_result(&ptr, EFI_DEVICE_ERROR);
-                return;
-            }
+        if (!varstore_insert(l)) {
+            varstore_free(l);
+            varstore_abort(mark);
+            serialize_result(&ptr, EFI_DEVICE_ERROR);
+            return;
+        }
+        if (!varstore_commit(persistent ? db->set_variable : NULL)) {
+            serialize_result(&ptr, EFI_DEVICE_ERROR);
+            return;
         }
         serialize_result(&ptr, EFI_SUCCESS);
     }
 
     return;
 
-err:
-    free(name);
-    free(data);
+abort:
+    varstore_abort(mark);
 }
 
 static void
@@ -1911,7 +2443,7 @@ do_get_next_variable(uint8_t *comm_buf)
     unserialize_uint32(&ptr); /* version */
     unserialize_command(&ptr);
     avail_len = unserialize_uintn(&ptr);
-    name = unserialize_data(&ptr, &name_len, NAME_LIMIT);
+    name = unserialize_data_arena(&ptr, &name_len, NAME_LIMIT, &req_arena);
     if (!name && name_len) {
         serialize_result(&comm_buf, EFI_DEVICE_ERROR);
         return;
@@ -1920,28 +2452,17 @@ do_get_next_variable(uint8_t *comm_buf)
     at_runtime = unserialize_boolean(&ptr);
 
     ptr = comm_buf;
-    l = var_list;
+    l = NULL;
 
     if (name_len) {
-        while (l) {
-            if (l->name_len == name_len &&
-                    !memcmp(l->name, name, name_len) &&
-                    !memcmp(&l->guid, &guid, GUID_LEN) &&
-                    (!at_runtime || (l->attributes & EFI_VARIABLE_RUNTIME_ACCESS)))
-                break;
-            l = l->next;
-        }
-        if (!l) {
+        l = varstore_lookup(name, name_len, &guid);
+        if (!l || (at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS))) {
             /* Given name & guid didn't match an existing variable */
             serialize_result(&ptr, EFI_INVALID_PARAMETER);
-            goto out;
+            return;
         }
-        l = l->next;
     }
-
-    /* Find the next valid variable, if any. */
-    while (at_runtime && l && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS))
-        l = l->next;
+    l = varstore_next(l, at_runtime);
 
     if (l) {
         if (avail_len < l->name_len + sizeof(CHAR16)) {
@@ -1955,9 +2476,77 @@ do_get_next_variable(uint8_t *comm_buf)
     } else {
         serialize_result(&ptr, EFI_NOT_FOUND);
     }
+}
 
-out:
-    free(name);
+/*
+ * Returns as many variables as fit in the buffer, in the same order as
+ * GetNextVariableName, starting after the (name, GUID) token given by the
+ * caller. An empty name starts from the beginning. When more follows, the
+ * caller passes the name and GUID of the last entry returned as the next
+ * token. The token need not still exist.
+ */
+static void
+do_get_variable_names(uint8_t *comm_buf)
+{
+    UINTN name_len, entry_len;
+    uint8_t *ptr, *name, *count_ptr;
+    struct efi_variable key = {0}, *l;
+    UINT32 flags, count = 0;
+    BOOLEAN at_runtime;
+
+    ptr = comm_buf;
+    unserialize_uint32(&ptr); /* version */
+    unserialize_command(&ptr);
+    flags = unserialize_uint32(&ptr);
+    name = unserialize_data_arena(&ptr, &name_len, NAME_LIMIT, &req_arena);
+    if (!name && name_len) {
+        serialize_result(&comm_buf, EFI_DEVICE_ERROR);
+        return;
+    }
+    unserialize_guid(&ptr, &key.guid);
+    at_runtime = unserialize_boolean(&ptr);
+
+    ptr = comm_buf;
+
+    if ((flags & ~GET_NAMES_WITH_DATA) ||
+        (at_runtime && (flags & GET_NAMES_WITH_DATA))) {
+        serialize_result(&ptr, EFI_INVALID_PARAMETER);
+        return;
+    }
+
+    key.name = name;
+    key.name_len = name_len;
+    l = varstore_next(name_len ? &key : NULL, at_runtime);
+
+    serialize_result(&ptr, EFI_SUCCESS);
+    count_ptr = ptr;
+    ptr += 2 * sizeof(UINT32);
+
+    for (; l; l = varstore_next(l, at_runtime)) {
+        entry_len = GUID_LEN + sizeof(UINTN) + l->name_len +
+                    sizeof(UINT32) + sizeof(UINTN);
+        if (flags & GET_NAMES_WITH_DATA)
+            entry_len += sizeof(UINTN) + l->data_len;
+        if (entry_len > SHMEM_SIZE - (size_t)(ptr - comm_buf))
+            break;
+
+        serialize_guid(&ptr, &l->guid);
+        serialize_data(&ptr, l->name, l->name_len);
+        serialize_uint32(&ptr, l->attributes);
+        serialize_uintn(&ptr, l->data_len);
+        if (flags & GET_NAMES_WITH_DATA)
+            serialize_data(&ptr, l->data, l->data_len);
+        count++;
+    }
+
+    if (l && count == 0) {
+        ptr = comm_buf;
+        serialize_result(&ptr, EFI_BUFFER_TOO_SMALL);
+        return;
+    }
+
+    serialize_uint32(&count_ptr, count);
+    serialize_uint32(&count_ptr, !!l); /* more */
 }
 
 static void
@@ -1984,7 +2573,7 @@ do_query_variable_info(uint8_t *comm_buf)
      */
     serialize_result(&ptr, EFI_SUCCESS);
     serialize_uint64(&ptr, TOTAL_LIMIT);
-    serialize_uint64(&ptr, TOTAL_LIMIT - get_space_usage());
+    serialize_uint64(&ptr, TOTAL_LIMIT - varstore_total_usage());
     serialize_uint64(&ptr, DATA_LIMIT);
 }
 
@@ -2017,19 +2606,236 @@ do_notify_sb_failure(uint8_t *comm_buf)
     serialize_result(&ptr, ret ? EFI_SUCCESS : EFI_DEVICE_ERROR);
 }
 
+/*
+ * Returns the length of the batch record at off, or 0 if the record does not
+ * fit in the buffer or is too short to hold a status.
+ */
+static UINT32
+batch_record_len(const uint8_t *comm_buf, size_t off)
+{
+    UINT32 len;
+
+    if (off + sizeof(len) > SHMEM_SIZE)
+        return 0;
+    memcpy(&len, comm_buf + off, sizeof(len));
+    if (len < sizeof(EFI_STATUS) || len > SHMEM_SIZE - off - sizeof(len))
+        return 0;
+
+    return len;
+}
+
+/* Fixed part of a successful GetVariable response. */
+#define GET_VARIABLE_REPLY_LEN \
+    (sizeof(EFI_STATUS) + sizeof(UINT32) + sizeof(UINTN))
+/* Fixed part of a successful GetNextVariableName response. */
+#define GET_NEXT_VARIABLE_REPLY_LEN \
+    (sizeof(EFI_STATUS) + sizeof(UINTN) + GUID_LEN)
+
+/*
+ * Limits the buffer size given by a GetVariable or GetNextVariableName record
+ * to what its response can use in len bytes, so that data which does not fit
+ * is reported with EFI_BUFFER_TOO_SMALL rather than cut off.
+ */
+static void
+batch_limit_request(uint8_t *scratch, UINT32 len)
+{
+    uint8_t *ptr = scratch + sizeof(UINT32); /* version */
+    UINTN name_len, size, limit;
+
+    switch (unserialize_command(&ptr)) {
+    case COMMAND_GET_VARIABLE:
+        name_len = unserialize_uintn(&ptr);
+        if (name_len > NAME_LIMIT)
+            return;
+        ptr += name_len + GUID_LEN;
+        limit = len > GET_VARIABLE_REPLY_LEN ?
+                len - GET_VARIABLE_REPLY_LEN : 0;
+        break;
+    case COMMAND_GET_NEXT_VARIABLE:
+        /* The terminating null is counted but not returned. */
+        limit = len > GET_NEXT_VARIABLE_REPLY_LEN ?
+                len - GET_NEXT_VARIABLE_REPLY_LEN + sizeof(CHAR16) : 0;
+        break;
+    default:
+        return;
+    }
+
+    memcpy(&size, ptr, sizeof(size));
+    if (size > limit)
+        serialize_uintn(&ptr, limit);
+}
+
+/* Returns the length of the response to command left in scratch. */
+static size_t
+batch_reply_len(const uint8_t *scratch, enum command_t command)
+{
+    uint8_t *ptr = (uint8_t *)scratch;
+    EFI_STATUS status;
+
+    status = unserialize_uintn(&ptr);
+    if (status == EFI_BUFFER_TOO_SMALL &&
+        (command == COMMAND_GET_VARIABLE ||
+         command == COMMAND_GET_NEXT_VARIABLE))
+        return sizeof(EFI_STATUS) + sizeof(UINTN);
+    if (status != EFI_SUCCESS)
+        return sizeof(EFI_STATUS);
+
+    switch (command) {
+    case COMMAND_GET_VARIABLE:
+        unserialize_uint32(&ptr); /* attributes */
+        return GET_VARIABLE_REPLY_LEN + unserialize_uintn(&ptr);
+    case COMMAND_GET_NEXT_VARIABLE:
+        return GET_NEXT_VARIABLE_REPLY_LEN + unserialize_uintn(&ptr);
+    case COMMAND_QUERY_VARIABLE_INFO:
+        return sizeof(EFI_STATUS) + 3 * sizeof(UINT64);
+    default:
+        return sizeof(EFI_STATUS);
+    }
+}
+
+/*
+ * Protocol version 2 carries a batch of commands in one buffer so that a
+ * single port write can service many calls:
+ *
+ *   request:  UINT32 version (2), UINT32 count, then count records each made
+ *             of a UINT32 length followed by that many bytes holding the
+ *             UINT32 command and its version 1 arguments.
+ *   response: EFI_STATUS for the batch, written over version and count. Each
+ *             record's version 1 response, starting with its own EFI_STATUS,
+ *             is written over the record after the length field.
+ *
+ * Every record must be long enough to hold an EFI_STATUS. Buffer sizes in
+ * GetVariable and GetNextVariableName records are limited to what fits in
+ * the record, and any other response that does not fit is replaced with
+ * EFI_BUFFER_TOO_SMALL. The records are all checked before any is run so a
+ * malformed batch is rejected as a whole with EFI_INVALID_PARAMETER.
+ */
+static void
+do_batch(uint8_t *comm_buf)
+{
+    uint8_t scratch[SHMEM_SIZE];
+    uint8_t *ptr, *rec;
+    enum command_t command;
+    UINT32 count, len, i;
+    size_t off, mark;
+
+    ptr = comm_buf;
+    unserialize_uint32(&ptr); /* version */
+    count = unserialize_uint32(&ptr);
+
+    off = ptr - comm_buf;
+    for (i = 0; i < count; i++) {
+        len = batch_record_len(comm_buf, off);
+        if (!len) {
+            ptr = comm_buf;
+            serialize_result(&ptr, EFI_INVALID_PARAMETER);
+            return;
+        }
+        off += sizeof(len) + len;
+    }
+
+    /*
+     * Each command runs on a private copy of its record so that it cannot
+     * write past the end of the record or the shared buffer. The lengths are
+     * checked again since the guest can change them at any time.
+     */
+    off = 2 * sizeof(UINT32);
+    mark = arena_mark(&req_arena);
+    for (i = 0; i < count; i++) {
+        len = batch_record_len(comm_buf, off);
+        if (!len)
+            break;
+        rec = comm_buf + off + sizeof(len);
+
+        /*
+         * A short record must read zeros past its end rather than the
+         * previous response, which may extend anywhere in the buffer.
+         */
+        ptr = scratch;
+        serialize_uint32(&ptr, 1); /* version */
+        memcpy(ptr, rec, len);
+        memset(ptr + len, 0, sizeof(scratch) - (ptr - scratch) - len);
+        batch_limit_request(scratch, len);
+
+        command = unserialize_command(&ptr);
+        switch (command) {
+        case COMMAND_GET_VARIABLE:
+            do_get_variable(scratch);
+            break;
+        case COMMAND_SET_VARIABLE:
+            do_set_variable(scratch);
+            break;
+        case COMMAND_GET_NEXT_VARIABLE:
+            do_get_next_variable(scratch);
+            break;
+        case COMMAND_QUERY_VARIABLE_INFO:
+            do_query_variable_info(scratch);
+            break;
+        default:
+            ptr = scratch;
+            serialize_result(&ptr, EFI_UNSUPPORTED);
+            break;
+        }
+
+        if (batch_reply_len(scratch, command) > len) {
+            ptr = scratch;
+            serialize_result(&ptr, EFI_BUFFER_TOO_SMALL);
+        }
+        memcpy(rec, scratch, len);
+        off += sizeof(len) + len;
+        arena_release(&req_arena, mark);
+    }
+
+    ptr = comm_buf;
+    serialize_result(&ptr, EFI_SUCCESS);
+}
+
+static bool
+command_is_read_only(enum command_t command)
+{
+    switch (command) {
+    case COMMAND_GET_VARIABLE:
+    case COMMAND_GET_NEXT_VARIABLE:
+    case COMMAND_QUERY_VARIABLE_INFO:
+    case COMMAND_GET_VARIABLE_NAMES:
+        return true;
+    default:
+        return false;
+    }
+}
+
 void dispatch_command(uint8_t *comm_buf)
 {
     enum command_t command;
     UINT32 version;
     uint8_t *ptr = comm_buf;
+    size_t mark;
+
+    if (!req_arena.base && !arena_init(&req_arena, REQUEST_ARENA_SIZE)) {
+        serialize_result(&ptr, EFI_DEVICE_ERROR);
+        return;
+    }
+    mark = arena_mark(&req_arena);
 
     version = unserialize_uint32(&ptr);
+    if (version == 2) {
+        DBG("Command batch\n");
+        store_lock_exclusive();
+        do_batch(comm_buf);
+        store_unlock();
+        return;
+    }
     if (version != 1) {
         DBG("Unknown version: %u\n", version);
         return;
     }
 
     command = unserialize_command(&ptr);
+    if (command_is_read_only(command))
+        store_lock_shared();
+    else
+        store_lock_exclusive();
+
     switch (command) {
     case COMMAND_GET_VARIABLE:
         DBG("COMMAND_GET_VARIABLE\n");
@@ -2051,10 +2857,17 @@ void dispatch_command(uint8_t *comm_buf)
         DBG("COMMAND_NOTIFY_SB_FAILURE\n");
         do_notify_sb_failure(comm_buf);
         break;
+    case COMMAND_GET_VARIABLE_NAMES:
+        DBG("COMMAND_GET_VARIABLE_NAMES\n");
+        do_get_variable_names(comm_buf);
+        break;
     default:
         DBG("Unknown command\n");
         break;
     };
+
+    store_unlock();
+    arena_release(&req_arena, mark);
 }
 
 bool
@@ -2069,8 +2882,11 @@ setup_variables(void)
     EFI_STATUS status;
     UINTN data_len;
     uint8_t setup_mode = 0;
-    uint8_t *data;
+    const uint8_t *data;
     uint8_t secure_boot = 0, deployed_mode = 1, audit_mode = 0;
+    size_t mark;
+
+    mark = varstore_begin();
 
     status = internal_set_variable(EFI_SIGNATURE_SUPPORT_NAME,
                                    sizeof(EFI_SIGNATURE_SUPPORT_NAME),
@@ -2079,19 +2895,18 @@ setup_variables(void)
                                    sizeof(mSignatureSupport),
                                    ATTR_BR);
     if (status != EFI_SUCCESS)
-        return false;
+        goto err;
 
-    status = internal_get_variable(EFI_PLATFORM_KEY_NAME,
-                                   sizeof(EFI_PLATFORM_KEY_NAME),
-                                   &gEfiGlobalVariableGuid, &data, &data_len);
+    status = internal_view_variable(EFI_PLATFORM_KEY_NAME,
+                                    sizeof(EFI_PLATFORM_KEY_NAME),
+                                    &gEfiGlobalVariableGuid, &data, &data_len);
     if (status == EFI_NOT_FOUND) {
         setup_mode = 1;
         deployed_mode = 0;
     } else if (status == EFI_SUCCESS) {
-        free(data);
         secure_boot = secure_boot_enable;
     } else {
-        return false;
+        goto err;
     }
 
     status = internal_set_variable(EFI_SETUP_MODE_NAME,
@@ -2101,7 +2916,7 @@ setup_variables(void)
                                    sizeof(setup_mode),
                                    ATTR_BR);
     if (status != EFI_SUCCESS)
-        return false;
+        goto err;
 
     status = internal_set_variable(EFI_AUDIT_MODE_NAME,
                                    sizeof(EFI_AUDIT_MODE_NAME),
@@ -2110,7 +2925,7 @@ setup_variables(void)
                                    sizeof(audit_mode),
                                    ATTR_BR);
     if (status != EFI_SUCCESS)
-        return false;
+        goto err;
 
     status = internal_set_variable(EFI_DEPLOYED_MODE_NAME,
                                    sizeof(EFI_DEPLOYED_MODE_NAME),
@@ -2119,7 +2934,7 @@ setup_variables(void)
                                    sizeof(deployed_mode),
                                    ATTR_BR);
     if (status != EFI_SUCCESS)
-        return false;
+        goto err;
 
     status = internal_set_variable(EFI_SECURE_BOOT_MODE_NAME,
                                    sizeof(EFI_SECURE_BOOT_MODE_NAME),
@@ -2128,9 +2943,14 @@ setup_variables(void)
                                    sizeof(secure_boot),
                                    ATTR_BR);
     if (status != EFI_SUCCESS)
-        return false;
+        goto err;
 
-    return true;
+    /* These are all volatile so there is nothing to flush. */
+    return varstore_commit(NULL);
+
+err:
+    varstore_abort(mark);
+    return false;
 }
 
 static bool
@@ -2168,8 +2988,12 @@ set_variable_from_auth(const uint8_t *name, UINTN name_len, const EFI_GUID *guid
 bool
 setup_keys(void)
 {
+    size_t mark;
     int i;
 
+    /* Set all the keys in one transaction so they are saved once. */
+    mark = varstore_begin();
+
     for (i = 0; i < ARRAY_SIZE(auth_info); i++) {
         if (!auth_info[i].data) {
             WARN("Cannot setup %s because auth data is missing!\n",
@@ -2187,7 +3011,7 @@ setup_keys(void)
              * KEK/db set which will cause in-guest dbx updates to fail.
              */
             WARN("Aborting keys setup\n");
-            return true;
+            break;
         }
 
         INFO("Setting %s...\n", auth_info[i].pretty_name);
@@ -2196,8 +3020,15 @@ setup_keys(void)
                                     auth_info[i].guid,
                                     auth_info[i].data,
                                     auth_info[i].data_len,
-                                    auth_info[i].append))
+                                    auth_info[i].append)) {
+            varstore_abort(mark);
             return false;
+        }
+    }
+
+    if (!varstore_commit(persistent ? db->set_variable : NULL)) {
+        ERR("Failed to save keys\n");
+        return false;
     }
 
     return true;
@@ -32,49 +32,171 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <time.h>
 
 #include <xenctrl.h>
 #include <debug.h>
 #include <handler_port.h>
+#include <ring_port.h>
+#include <serialize.h>
 
 #include "io_port.h"
 
 #define HANDLER_PORT_ADDRESS 0x0100
 
+/*
+ * Mappings of the guest's communication buffer are kept between commands,
+ * keyed on the base PFN the guest writes to the port. A handful of entries
+ * is enough: a guest normally uses a single buffer, but firmware and the OS
+ * may each have their own.
+ *
+ * Each thread serving ioreqs has its own cache so a mapping can be used
+ * without locking. Invalidation bumps a shared generation, which makes
+ * every thread drop its mappings before its next command.
+ */
+#define MAP_CACHE_SIZE 4
+
+struct map_entry {
+    xen_pfn_t base;
+    void *shmem; /* NULL if the entry is unused */
+    uint64_t last_used;
+};
+
+struct map_cache {
+    struct map_entry entry[MAP_CACHE_SIZE];
+    uint64_t tick;
+    unsigned int generation;
+};
+
 static struct {
     xenforeignmemory_handle *fmem;
     domid_t domid;
+    unsigned int generation;
+    struct handler_port_stats stats; /* Updated atomically */
 } io_info;
 
+static __thread struct map_cache cache;
+
+#define STAT_ADD(field, val) \
+    __atomic_fetch_add(&io_info.stats.field, (val), __ATOMIC_RELAXED)
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void
-io_port_writel(uint64_t offset, uint64_t size, uint32_t val)
+unmap_entry(struct map_entry *e)
+{
+    uint64_t start;
+
+    if (!e->shmem)
+        return;
+
+    start = now_ns();
+    xenforeignmemory_unmap(io_info.fmem, e->shmem, SHMEM_PAGES);
+    STAT_ADD(unmaps, 1);
+    STAT_ADD(unmap_ns, now_ns() - start);
+    e->shmem = NULL;
+}
+
+/*
+ * Returns a mapping of the SHMEM_PAGES guest frames starting at base, reusing
+ * a cached one if possible and otherwise replacing the least recently used.
+ */
+static void *
+map_buffer(xen_pfn_t base)
 {
     xen_pfn_t pfns[SHMEM_PAGES];
-    void *shmem;
+    struct map_entry *e, *victim = &cache.entry[0];
+    unsigned int generation;
+    uint64_t start;
     int i;
 
-    if (offset != 0 || size != sizeof(uint32_t)) {
-        DBG("Expected size 4, offset 0.  Got %" PRIu64 ", %" PRIu64 ".\n", size, offset);
-        return;
+    generation = __atomic_load_n(&io_info.generation, __ATOMIC_ACQUIRE);
+    if (cache.generation != generation) {
+        release_handler_io_port();
+        cache.generation = generation;
+    }
+
+    cache.tick++;
+    for (i = 0; i < MAP_CACHE_SIZE; i++) {
+        e = &cache.entry[i];
+        if (e->shmem && e->base == base) {
+            e->last_used = cache.tick;
+            STAT_ADD(hits, 1);
+            return e->shmem;
+        }
+        if (!e->shmem || (victim->shmem && e->last_used < victim->last_used))
+            victim = e;
     }
 
+    unmap_entry(victim);
+
     for (i = 0; i < SHMEM_PAGES; i++)
-        pfns[i] = val + i;
-    DBG("io_port write\n");
+        pfns[i] = base + i;
 
-    shmem = xenforeignmemory_map(io_info.fmem,
-                                 io_info.domid,
-                                 PROT_READ | PROT_WRITE,
-                                 SHMEM_PAGES, pfns, NULL);
-    if (!shmem) {
+    start = now_ns();
+    victim->shmem = xenforeignmemory_map(io_info.fmem,
+                                         io_info.domid,
+                                         PROT_READ | PROT_WRITE,
+                                         SHMEM_PAGES, pfns, NULL);
+    STAT_ADD(maps, 1);
+    STAT_ADD(map_ns, now_ns() - start);
+    if (!victim->shmem) {
         DBG("map foreign range failed: %d\n", errno);
+        return NULL;
+    }
+    victim->base = base;
+    victim->last_used = cache.tick;
+
+    return victim->shmem;
+}
+
+/* COMMAND_SETUP_RING needs Xen so it is handled here rather than by handler.c. */
+static bool
+setup_ring(uint8_t *shmem)
+{
+    uint8_t *ptr = shmem;
+    xen_pfn_t base;
+    evtchn_port_t port;
+
+    if (unserialize_uint32(&ptr) != 1 ||
+        unserialize_command(&ptr) != COMMAND_SETUP_RING)
+        return false;
+
+    DBG("COMMAND_SETUP_RING\n");
+    base = unserialize_uintn(&ptr);
+    port = unserialize_uint32(&ptr);
+
+    ptr = shmem;
+    serialize_result(&ptr, connect_ring_port(base, port));
+    return true;
+}
+
+static void
+io_port_writel(uint64_t offset, uint64_t size, uint32_t val)
+{
+    void *shmem;
+
+    if (offset != 0 || size != sizeof(uint32_t)) {
+        DBG("Expected size 4, offset 0.  Got %" PRIu64 ", %" PRIu64 ".\n", size, offset);
         return;
     }
 
-    dispatch_command(shmem);
+    DBG("io_port write\n");
 
-    xenforeignmemory_unmap(io_info.fmem, shmem, SHMEM_PAGES);
+    shmem = map_buffer(val);
+    if (!shmem)
+        return;
 
+    STAT_ADD(commands, 1);
+    if (!setup_ring(shmem))
+        dispatch_command(shmem);
 }
 
 bool
@@ -86,3 +208,51 @@ setup_handler_io_port(domid_t domid, xenforeignmemory_handle *fmem) {
     return register_io_port_writel_handler(HANDLER_PORT_ADDRESS, io_port_writel);
 }
 
+/*
+ * Drops all cached mappings, in every thread. Must be called whenever the
+ * guest's physical memory layout may have changed (e.g. on a mapcache
+ * invalidate request after the guest gave memory back) since a mapping
+ * refers to the frames that backed the PFNs at the time it was made.
+ */
+void
+invalidate_handler_io_port(void)
+{
+    __atomic_fetch_add(&io_info.generation, 1, __ATOMIC_RELEASE);
+    release_handler_io_port();
+}
+
+/* Drops the calling thread's cached mappings. */
+void
+release_handler_io_port(void)
+{
+    int i;
+
+    for (i = 0; i < MAP_CACHE_SIZE; i++)
+        unmap_entry(&cache.entry[i]);
+}
+
+void
+log_handler_port_stats(void)
+{
+    const struct handler_port_stats *s = &io_info.stats;
+
+    if (!s->commands)
+        return;
+
+    INFO("Buffer mappings: %" PRIu64 " commands, %" PRIu64 " hits, "
+         "%" PRIu64 " maps (%" PRIu64 " ns), %" PRIu64 " unmaps (%" PRIu64 " ns)\n",
+         s->commands, s->hits, s->maps, s->map_ns, s->unmaps, s->unmap_ns);
+}
+
+void
+teardown_handler_io_port(void)
+{
+    release_handler_io_port();
+    log_handler_port_stats();
+}
+
+const struct handler_port_stats *
+handler_port_stats(void)
+{
+    return &io_info.stats;
+}
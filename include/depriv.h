@@ -33,6 +33,6 @@
 #include <sys/types.h>
 
 bool drop_privileges(const char *opt_chroot, bool opt_depriv, gid_t opt_gid,
-                     uid_t opt_uid);
+                     uid_t opt_uid, unsigned int nr_threads);
 
 #endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+
+/*
+ * Single-threaded epoll loop. Sources are file descriptors, which are
+ * watched for readability, and timers. Handlers run from event_dispatch() in
+ * the thread that calls it.
+ */
+struct event;
+
+typedef void (*event_fn)(void *opaque);
+
+bool event_init(void);
+void event_destroy(void);
+
+struct event *event_add_fd(int fd, event_fn fn, void *opaque);
+
+/*
+ * Timers fire after ms milliseconds and then every ms if periodic. A one-shot
+ * timer stays registered once it has fired and may be re-armed with
+ * event_set_timer(). A zero interval disarms the timer.
+ */
+struct event *event_add_timer(unsigned int ms, bool periodic,
+                              event_fn fn, void *opaque);
+bool event_set_timer(struct event *ev, unsigned int ms, bool periodic);
+
+void event_remove(struct event *ev);
+
+/* Waits up to timeout_ms (-1 for ever) and runs the handlers that are ready. */
+bool event_dispatch(int timeout_ms);
+
+#endif
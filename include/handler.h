@@ -58,6 +58,28 @@ enum command_t {
     COMMAND_GET_NEXT_VARIABLE,
     COMMAND_QUERY_VARIABLE_INFO,
     COMMAND_NOTIFY_SB_FAILURE,
+    COMMAND_GET_VARIABLE_NAMES,
+    COMMAND_SETUP_RING, /* Handled by the port transport, see ring.h */
+};
+
+/* Flags for COMMAND_GET_VARIABLE_NAMES */
+#define GET_NAMES_WITH_DATA 0x1 /* Include payloads, boot services only */
+
+/*
+ * Each variable is also linked into the partitions matching its attributes.
+ * A variable is in exactly one of VAR_PART_NV and VAR_PART_VOLATILE, and
+ * additionally in VAR_PART_RUNTIME if it has runtime access.
+ */
+enum var_partition {
+    VAR_PART_NV,
+    VAR_PART_VOLATILE,
+    VAR_PART_RUNTIME,
+    VAR_PART_COUNT,
+};
+
+struct var_link {
+    struct efi_variable *prev;
+    struct efi_variable *next;
 };
 
 struct efi_variable {
@@ -69,7 +91,13 @@ struct efi_variable {
     UINT32 attributes;
     EFI_TIME timestamp;
     uint8_t cert[SHA256_DIGEST_SIZE];
+    size_t rec_cap; /* Allocated size of the record, see varstore_new() */
+    size_t data_cap; /* Space available at data */
+    uint32_t hash; /* Cached varstore_hash() of name and GUID */
+    uint64_t generation; /* Unique stamp, renewed whenever the data changes */
+    struct efi_variable *prev;
     struct efi_variable *next;
+    struct var_link part[VAR_PART_COUNT];
 };
 
 extern struct efi_variable *var_list;
@@ -81,12 +109,20 @@ bool setup_keys(void);
 bool load_auth_data(void);
 void free_auth_data(void);
 
+void store_lock_shared(void);
+void store_lock_exclusive(void);
+void store_unlock(void);
+void free_request_arena(void);
+
 EFI_STATUS
 internal_set_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
                       const uint8_t *data, UINTN data_len, UINT32 attr);
 EFI_STATUS
 internal_get_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
                       uint8_t **data, UINTN *data_len);
+EFI_STATUS
+internal_view_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+                       const uint8_t **data, UINTN *data_len);
 
 extern const uint8_t TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME[];
 extern const size_t TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME_SIZE;
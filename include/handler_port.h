@@ -35,6 +35,21 @@
 #include <xenforeignmemory.h>
 
 
+/* Counters for the guest buffer mapping cache. */
+struct handler_port_stats {
+    uint64_t commands;
+    uint64_t hits;
+    uint64_t maps;
+    uint64_t map_ns;
+    uint64_t unmaps;
+    uint64_t unmap_ns;
+};
+
 bool setup_handler_io_port(domid_t domid, xenforeignmemory_handle *fmem);
+void invalidate_handler_io_port(void);
+void release_handler_io_port(void);
+void teardown_handler_io_port(void);
+void log_handler_port_stats(void);
+const struct handler_port_stats *handler_port_stats(void);
 
 #endif
@@ -30,8 +30,6 @@
 #define MOR_H
 
 bool setup_mor_variables(void);
-bool is_mor_control(uint8_t *name, UINTN name_len, EFI_GUID *guid);
-bool is_mor_control_lock(uint8_t *name, UINTN name_len, EFI_GUID *guid);
 EFI_STATUS do_set_mor_control(uint8_t *data, UINTN data_len, UINT32 attr, BOOLEAN append);
 EFI_STATUS do_set_mor_control_lock(uint8_t *data, UINTN data_len,
                                    UINT32 attr, BOOLEAN append);
@@ -39,4 +37,12 @@ EFI_STATUS do_set_mor_control_lock(uint8_t *data, UINTN data_len,
 #define MOR_LOCK_REV2_LEN 8
 extern uint8_t mor_key[MOR_LOCK_REV2_LEN];
 
+/* Sizes of the UTF-16 names, without a terminator. */
+#define MOR_CONTROL_NAME_SIZE 58
+#define MOR_CONTROL_LOCK_NAME_SIZE 66
+extern const uint8_t MOR_CONTROL_NAME[MOR_CONTROL_NAME_SIZE];
+extern const uint8_t MOR_CONTROL_LOCK_NAME[MOR_CONTROL_LOCK_NAME_SIZE];
+extern const EFI_GUID morControlGuid;
+extern const EFI_GUID morControlLockGuid;
+
 #endif
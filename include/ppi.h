@@ -42,5 +42,7 @@ extern ppi_vdata_t ppi_vdata;
 
 bool setup_ppi_port(void);
 bool setup_ppi_variables(void);
+bool setup_ppi_flush(void);
+void flush_ppi_variables(void);
 
 #endif
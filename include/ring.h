@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <handler.h>
+
+/*
+ * Optional transport modelled on Xen PV rings. The guest shares one area
+ * with varstored, once, using COMMAND_SETUP_RING on the I/O port:
+ *
+ *   Request:  UINT32 version (1), UINT32 command, UINT64 first guest frame,
+ *             UINT32 event channel port the guest allocated for varstored
+ *   Response: EFI_STATUS
+ *
+ * The area is RING_PAGES contiguous guest frames. The first page holds
+ * struct varstore_sring. It is followed by RING_SLOTS command buffers of
+ * SHMEM_SIZE each, which use the same format as the I/O port transport.
+ *
+ * To issue a command the guest fills a free slot, queues a request naming
+ * it and kicks the event channel if req_event asks for it. The command is
+ * answered in place in the slot and a response carrying the same entry is
+ * queued, with a kick if rsp_event asks for it. The guest must not have
+ * more than RING_ENTRIES requests and responses outstanding, otherwise the
+ * ring is disconnected and must be set up again.
+ */
+#define RING_SLOTS 4
+#define RING_ENTRIES 8 /* Must be a power of two */
+#define RING_PAGES (1 + RING_SLOTS * SHMEM_PAGES)
+#define RING_SIZE (RING_PAGES * PAGE_SIZE)
+
+struct varstore_ring_entry {
+    uint32_t id; /* Opaque to varstored */
+    uint32_t slot;
+};
+
+struct varstore_sring {
+    uint32_t req_prod;
+    uint32_t req_event;
+    uint32_t rsp_prod;
+    uint32_t rsp_event;
+    struct varstore_ring_entry req[RING_ENTRIES];
+    struct varstore_ring_entry rsp[RING_ENTRIES];
+};
+
+/* varstored's private view of the ring. */
+struct ring_backend {
+    struct varstore_sring *sring;
+    uint8_t *slots;
+    uint32_t req_cons;
+    uint32_t rsp_prod_pvt;
+    bool overflowed; /* Set once the guest overran the ring */
+};
+
+void ring_init(struct ring_backend *rb, void *area);
+bool ring_process(struct ring_backend *rb);
+
+#endif
@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "arena.h"
 #include "efi.h"
 #include "handler.h"
 
@@ -120,6 +121,27 @@ unserialize_data(uint8_t **ptr, UINTN *len, UINTN limit)
     return data;
 }
 
+/* As unserialize_data() but the copy is taken from arena. */
+static inline uint8_t *
+unserialize_data_arena(uint8_t **ptr, UINTN *len, UINTN limit,
+                       struct arena *arena)
+{
+    uint8_t *data;
+
+    memcpy(len, *ptr, sizeof(*len));
+    *ptr += sizeof *len;
+
+    if (*len > limit || *len == 0)
+        return NULL;
+
+    data = arena_memdup(arena, *ptr, *len);
+    if (!data)
+        return NULL;
+    *ptr += *len;
+
+    return data;
+}
+
 static inline void
 unserialize_data_inplace(uint8_t **ptr, uint8_t *buf, UINTN len)
 {
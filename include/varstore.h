@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VARSTORE_H
+#define VARSTORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "efi.h"
+#include "handler.h"
+
+/*
+ * Index over var_list keyed on (GUID, name). var_list remains the owner of
+ * the variables; the index only makes lookups, inserts and deletes O(1).
+ *
+ * Variables are also chained per partition (see enum var_partition) with
+ * running totals so that space accounting does not need to walk the store,
+ * and kept in (GUID, name) order for enumeration with varstore_next().
+ *
+ * Changes can be grouped in transactions (varstore_begin() and friends)
+ * which are undone together on failure and saved with a single flush.
+ */
+
+/*
+ * Records are allocated from the slab allocator with the name, and data up
+ * to this size, stored inline after the struct. Larger payloads get their
+ * own size-classed chunk.
+ */
+#define VAR_INLINE_DATA 256
+
+struct varstore_usage {
+    uint64_t bytes; /* name + data + VARIABLE_SIZE_OVERHEAD per variable */
+    size_t count;
+};
+
+struct efi_variable *varstore_new(const uint8_t *name, UINTN name_len,
+                                  const EFI_GUID *guid,
+                                  const uint8_t *data, UINTN data_len);
+void varstore_free(struct efi_variable *var);
+bool varstore_set_data(struct efi_variable *var, const uint8_t *data,
+                       UINTN data_len);
+bool varstore_append_data(struct efi_variable *var, const uint8_t *data,
+                          UINTN data_len);
+
+uint32_t varstore_hash(const uint8_t *name, UINTN name_len, const EFI_GUID *guid);
+struct efi_variable *varstore_lookup(const uint8_t *name, UINTN name_len,
+                                     const EFI_GUID *guid);
+bool varstore_insert(struct efi_variable *var);
+bool varstore_remove(struct efi_variable *var);
+void varstore_replace(struct efi_variable *old, struct efi_variable *new);
+struct efi_variable *varstore_next(const struct efi_variable *var,
+                                   bool runtime_only);
+void varstore_compact(void);
+size_t varstore_begin(void);
+bool varstore_commit(bool (*flush)(void));
+void varstore_abort(size_t mark);
+void varstore_clear(void);
+
+struct efi_variable *varstore_first(enum var_partition p);
+const struct varstore_usage *varstore_usage(enum var_partition p);
+uint64_t varstore_total_usage(void);
+
+#endif
@@ -51,8 +51,8 @@
 
 uint8_t mor_key[MOR_LOCK_REV2_LEN];
 
-static const uint8_t MOR_CONTROL_NAME[] = {'M',0,'e',0,'m',0,'o',0,'r',0,'y',0,'O',0,'v',0,'e',0,'r',0,'w',0,'r',0,'i',0,'t',0,'e',0,'R',0,'e',0,'q',0,'u',0,'e',0,'s',0,'t',0,'C',0,'o',0,'n',0,'t',0,'r',0,'o',0,'l',0};
-static const uint8_t MOR_CONTROL_LOCK_NAME[] = {'M',0,'e',0,'m',0,'o',0,'r',0,'y',0,'O',0,'v',0,'e',0,'r',0,'w',0,'r',0,'i',0,'t',0,'e',0,'R',0,'e',0,'q',0,'u',0,'e',0,'s',0,'t',0,'C',0,'o',0,'n',0,'t',0,'r',0,'o',0,'l',0,'L',0,'o',0,'c',0,'k',0};
+const uint8_t MOR_CONTROL_NAME[] = {'M',0,'e',0,'m',0,'o',0,'r',0,'y',0,'O',0,'v',0,'e',0,'r',0,'w',0,'r',0,'i',0,'t',0,'e',0,'R',0,'e',0,'q',0,'u',0,'e',0,'s',0,'t',0,'C',0,'o',0,'n',0,'t',0,'r',0,'o',0,'l',0};
+const uint8_t MOR_CONTROL_LOCK_NAME[] = {'M',0,'e',0,'m',0,'o',0,'r',0,'y',0,'O',0,'v',0,'e',0,'r',0,'w',0,'r',0,'i',0,'t',0,'e',0,'R',0,'e',0,'q',0,'u',0,'e',0,'s',0,'t',0,'C',0,'o',0,'n',0,'t',0,'r',0,'o',0,'l',0,'L',0,'o',0,'c',0,'k',0};
 const EFI_GUID morControlGuid =
     {{0xbe, 0x39, 0x09, 0xe2, 0xd4, 0x32, 0xbe, 0x41, 0xa1, 0x50, 0x89, 0x7f, 0x85, 0xd4, 0x98, 0x29}};
 const EFI_GUID morControlLockGuid =
@@ -93,28 +93,12 @@ setup_mor_variables(void)
     return true;
 }
 
-bool
-is_mor_control(uint8_t *name, UINTN name_len, EFI_GUID *guid)
-{
-    return name_len == sizeof(MOR_CONTROL_NAME) &&
-           !memcmp(name, MOR_CONTROL_NAME, name_len) &&
-           !memcmp(guid, &morControlGuid, GUID_LEN);
-}
-
-bool
-is_mor_control_lock(uint8_t *name, UINTN name_len, EFI_GUID *guid)
-{
-    return name_len == sizeof(MOR_CONTROL_LOCK_NAME) &&
-           !memcmp(name, MOR_CONTROL_LOCK_NAME, name_len) &&
-           !memcmp(guid, &morControlLockGuid, GUID_LEN);
-}
-
 EFI_STATUS
 do_set_mor_control(uint8_t *data, UINTN data_len, UINT32 attr, BOOLEAN append)
 {
     EFI_STATUS status;
     uint8_t mor_locked_state;
-    uint8_t *buf;
+    const uint8_t *buf;
     UINTN buf_len;
 
     if (attr != ATTR_BRNV || append || data_len != MOR_CONTROL_LEN)
@@ -123,15 +107,14 @@ do_set_mor_control(uint8_t *data, UINTN data_len, UINT32 attr, BOOLEAN append)
     if (*data != (*data & MOR_ACTION_VALID_MASK))
         return EFI_INVALID_PARAMETER;
 
-    status = internal_get_variable(MOR_CONTROL_LOCK_NAME,
-                                   sizeof(MOR_CONTROL_LOCK_NAME),
-                                   &morControlLockGuid, &buf, &buf_len);
+    status = internal_view_variable(MOR_CONTROL_LOCK_NAME,
+                                    sizeof(MOR_CONTROL_LOCK_NAME),
+                                    &morControlLockGuid, &buf, &buf_len);
     if (status != EFI_SUCCESS)
         return status;
 
     assert(buf_len == 1);
     mor_locked_state = buf[0];
-    free(buf);
 
     if (mor_locked_state == MOR_LOCKED_WITH_KEY ||
             mor_locked_state == MOR_LOCKED_WITHOUT_KEY)
@@ -151,7 +134,7 @@ do_set_mor_control_lock(uint8_t *data, UINTN data_len,
 {
     EFI_STATUS status;
     uint8_t mor_locked_state;
-    uint8_t *buf;
+    const uint8_t *buf;
     UINTN buf_len;
 
     if (attr == 0 || data_len == 0)
@@ -161,15 +144,14 @@ do_set_mor_control_lock(uint8_t *data, UINTN data_len,
             (data_len != MOR_LOCK_REV1_LEN && data_len != MOR_LOCK_REV2_LEN))
         return EFI_INVALID_PARAMETER;
 
-    status = internal_get_variable(MOR_CONTROL_LOCK_NAME,
-                                   sizeof(MOR_CONTROL_LOCK_NAME),
-                                   &morControlLockGuid, &buf, &buf_len);
+    status = internal_view_variable(MOR_CONTROL_LOCK_NAME,
+                                    sizeof(MOR_CONTROL_LOCK_NAME),
+                                    &morControlLockGuid, &buf, &buf_len);
     if (status != EFI_SUCCESS)
         return status;
 
     assert(buf_len == 1);
     mor_locked_state = buf[0];
-    free(buf);
 
     if (data_len == MOR_LOCK_REV1_LEN) {
         if (*data == MOR_LOCK_REV1_UNLOCK) {
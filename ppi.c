@@ -34,6 +34,7 @@
 #include <handler.h>
 #include <backend.h>
 #include <debug.h>
+#include <event.h>
 #include <ppi.h>
 #include <efi.h>
 #include <guid.h>
@@ -49,17 +50,35 @@ static const uint8_t PPI_NAME[] = {'P',0,'P',0,'I',0,'B',0,'u',0,'f',0,'f',0,'e'
 #define PPI_NONVOLITILE_SIZE 48
 #define PPI_BUFF_SIZE (PPI_NONVOLITILE_SIZE + PPI_VOLATILE_SIZE)
 
+/*
+ * Firmware fills the non-volatile area a dword at a time, so pushing the
+ * store to the backend after each write is deferred until writes have
+ * stopped for PPI_FLUSH_DELAY_MS.
+ */
+#define PPI_FLUSH_DELAY_MS 20
+
+/*
+ * The operation requested by the guest, PPRequest in
+ * EFI_TCG2_PHYSICAL_PRESENCE, is at the start of the non-volatile area.
+ * Writes covering it are pushed to the backend straight away.
+ */
+#define PPI_REQUEST_OFFSET 0
+#define PPI_REQUEST_SIZE 1
+
+static struct event *ppi_flush_timer;
+static bool ppi_dirty; /* Protected by the store lock */
+
 bool
 setup_ppi_variables(void)
 {
     EFI_STATUS status;
     UINTN data_len;
-    uint8_t *data;
+    const uint8_t *data;
     uint8_t unlocked = 0;
 
-    status = internal_get_variable(PPI_NAME,
-                                   sizeof(PPI_NAME),
-                                   &gEfiTcg2PpiXenGuid, &data, &data_len);
+    status = internal_view_variable(PPI_NAME,
+                                    sizeof(PPI_NAME),
+                                    &gEfiTcg2PpiXenGuid, &data, &data_len);
     if (status == EFI_NOT_FOUND) {
         uint8_t buf[PPI_NONVOLITILE_SIZE] = {0};
 
@@ -75,10 +94,9 @@ setup_ppi_variables(void)
         }
     } else {
         if (status != EFI_SUCCESS) {
-           ERR("internal_get_variable returned 0x%016lx\n", status);
+           ERR("internal_view_variable returned 0x%016lx\n", status);
            return false;
         }
-        free(data);
     }
 
     status = internal_set_variable(TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME,
@@ -102,7 +120,9 @@ ppi_idx_port_writel(uint64_t offset, uint64_t size, uint32_t val)
         DBG("Bad PPI IDX write offset 0x%" PRIx64 ", size 0x%" PRIx64", val 0x%" PRIx32 "\n", offset, size, val);
         return;
     }
+    store_lock_exclusive();
     ppi_vdata.idx = val;
+    store_unlock();
 }
 
 static uint32_t
@@ -111,31 +131,39 @@ ppi_data_readl(uint64_t offset, uint64_t size)
     uint32_t ret = 0;
     EFI_STATUS status;
 
+    store_lock_shared();
+
     if (ppi_vdata.idx + size > PPI_BUFF_SIZE) {
        INFO("PPI IDX out of range. 0x%" PRIx32 "+ %" PRIx64 "\n", ppi_vdata.idx, size);
-       return 0;
+       goto out;
     }
 
     if (ppi_vdata.idx >= PPI_VOLATILE_SIZE) {
-        uint8_t *data;
+        const uint8_t *data;
         UINTN data_len;
-        status = internal_get_variable(PPI_NAME,
-                                       sizeof(PPI_NAME),
-                                       &gEfiTcg2PpiXenGuid, &data, &data_len);
+        status = internal_view_variable(PPI_NAME,
+                                        sizeof(PPI_NAME),
+                                        &gEfiTcg2PpiXenGuid, &data, &data_len);
 
-        if (status == EFI_SUCCESS) {
+        if (status == EFI_SUCCESS)
             memcpy(&ret, data + offset + (ppi_vdata.idx - PPI_VOLATILE_SIZE), size);
-            free(data);
-            return ret;
-        } else {
+        else
             ERR("ppi read failure 0x%016lx!\n", status);
-            return 0;
-        }
     } else {
         memcpy(&ret, ppi_vdata.func + offset + ppi_vdata.idx, size);
-        return ret;
     }
-    return 0;
+
+out:
+    store_unlock();
+    return ret;
+}
+
+/* Returns whether a write of size bytes at off sets the PPI request. */
+static bool
+ppi_is_request(uint32_t off, uint64_t size)
+{
+    return off < PPI_REQUEST_OFFSET + PPI_REQUEST_SIZE &&
+           off + size > PPI_REQUEST_OFFSET;
 }
 
 static void
@@ -143,9 +171,11 @@ ppi_data_port_writel(uint64_t offset, uint64_t size, uint32_t val)
 {
     EFI_STATUS status;
 
+    store_lock_exclusive();
+
     if (ppi_vdata.idx + size> PPI_BUFF_SIZE) {
        INFO("PP IDX out of range. 0x%" PRIx32 "+ %" PRIx64 "\n", ppi_vdata.idx, size);
-       return;
+       goto out;
     }
 
     if (ppi_vdata.idx >= PPI_VOLATILE_SIZE) {
@@ -165,7 +195,21 @@ ppi_data_port_writel(uint64_t offset, uint64_t size, uint32_t val)
                                               ATTR_BRNV);
                 free(data);
                 if (status == EFI_SUCCESS) {
-                    db->set_variable();
+                    /*
+                     * The write is acknowledged before the timer pushes it
+                     * to the backend, so it is lost if varstored dies in
+                     * the next PPI_FLUSH_DELAY_MS. Only status writes are
+                     * left in that window; the request is pushed now.
+                     */
+                    ppi_dirty = true;
+                    if (ppi_is_request(ppi_vdata.idx - PPI_VOLATILE_SIZE,
+                                       size) ||
+                        !ppi_flush_timer ||
+                        !event_set_timer(ppi_flush_timer, PPI_FLUSH_DELAY_MS,
+                                         false)) {
+                        ppi_dirty = false;
+                        db->set_variable();
+                    }
                 } else {
                     ERR("Set variable failure 0x%016lx!\n", status);
                 }
@@ -176,6 +220,34 @@ ppi_data_port_writel(uint64_t offset, uint64_t size, uint32_t val)
     } else {
         memcpy(ppi_vdata.func + ppi_vdata.idx + offset, &val, size);
     }
+
+out:
+    store_unlock();
+}
+
+static void
+ppi_flush(void *opaque)
+{
+    store_lock_exclusive();
+    if (ppi_dirty) {
+        ppi_dirty = false;
+        db->set_variable();
+    }
+    store_unlock();
+}
+
+void
+flush_ppi_variables(void)
+{
+    ppi_flush(NULL);
+}
+
+/* Must be called from the thread that runs the event loop. */
+bool
+setup_ppi_flush(void)
+{
+    ppi_flush_timer = event_add_timer(0, false, ppi_flush, NULL);
+    return ppi_flush_timer != NULL;
 }
 
 bool
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <debug.h>
+#include <handler.h>
+#include <ring.h>
+
+/* Requests queued before the ring is connected are ignored. */
+void
+ring_init(struct ring_backend *rb, void *area)
+{
+    rb->sring = area;
+    rb->slots = (uint8_t *)area + PAGE_SIZE;
+    rb->req_cons = __atomic_load_n(&rb->sring->req_prod, __ATOMIC_ACQUIRE);
+    rb->rsp_prod_pvt = rb->req_cons;
+    rb->overflowed = false;
+}
+
+/*
+ * Runs every queued request and publishes the responses. Returns whether the
+ * guest asked to be notified about them. As with Xen's
+ * RING_FINAL_CHECK_FOR_REQUESTS, req_event is set before looking for more
+ * work so that a request queued meanwhile is either seen here or kicks the
+ * event channel.
+ *
+ * Once the guest has queued more than the ring holds, nothing more is run
+ * and rb->overflowed is set so that the caller can disconnect the ring.
+ */
+bool
+ring_process(struct ring_backend *rb)
+{
+    struct varstore_sring *sring = rb->sring;
+    struct varstore_ring_entry entry;
+    uint32_t prod, old;
+    bool notify = false;
+
+    if (rb->overflowed)
+        return false;
+
+    for (;;) {
+        prod = __atomic_load_n(&sring->req_prod, __ATOMIC_ACQUIRE);
+        if (prod - rb->req_cons > RING_ENTRIES) {
+            ERR("Ring overflow: prod %u, cons %u\n", prod, rb->req_cons);
+            rb->overflowed = true;
+            return notify;
+        }
+
+        while (rb->req_cons != prod) {
+            entry = sring->req[rb->req_cons++ & (RING_ENTRIES - 1)];
+
+            if (entry.slot < RING_SLOTS)
+                dispatch_command(rb->slots + entry.slot * SHMEM_SIZE);
+            else
+                DBG("Bad ring slot %u\n", entry.slot);
+
+            sring->rsp[rb->rsp_prod_pvt++ & (RING_ENTRIES - 1)] = entry;
+        }
+
+        old = sring->rsp_prod;
+        __atomic_store_n(&sring->rsp_prod, rb->rsp_prod_pvt, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (rb->rsp_prod_pvt - sring->rsp_event < rb->rsp_prod_pvt - old)
+            notify = true;
+
+        sring->req_event = rb->req_cons + 1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&sring->req_prod, __ATOMIC_ACQUIRE) == rb->req_cons)
+            break;
+    }
+
+    return notify;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <debug.h>
+#include <ring.h>
+#include <ring_port.h>
+
+/*
+ * The guest connects the ring from a vCPU, which may be served by a worker
+ * thread, while its event channel is handled by the main loop.
+ */
+static struct {
+    pthread_mutex_t lock;
+    domid_t domid;
+    xenforeignmemory_handle *fmem;
+    xenevtchn_handle *evth;
+    xenevtchn_port_or_error_t port;
+    void *area;
+    struct ring_backend rb;
+} ring_info = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .port = -1,
+};
+
+/* Must be called before the Xen handles are restricted. */
+bool
+setup_ring_port(domid_t domid, xenforeignmemory_handle *fmem)
+{
+    int fd, flags;
+
+    ring_info.domid = domid;
+    ring_info.fmem = fmem;
+
+    ring_info.evth = xenevtchn_open(NULL, 0);
+    if (!ring_info.evth) {
+        ERR("Failed to open evtchn handle: %d, %s\n", errno, strerror(errno));
+        return false;
+    }
+
+    fd = xenevtchn_fd(ring_info.evth);
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ERR("Failed to make evtchn handle non-blocking: %d, %s\n",
+            errno, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+int
+ring_port_fd(void)
+{
+    return xenevtchn_fd(ring_info.evth);
+}
+
+static void
+disconnect(void)
+{
+    if (ring_info.port >= 0)
+        xenevtchn_unbind(ring_info.evth, ring_info.port);
+    ring_info.port = -1;
+
+    if (ring_info.area)
+        xenforeignmemory_unmap(ring_info.fmem, ring_info.area, RING_PAGES);
+    ring_info.area = NULL;
+}
+
+/* Replaces any ring that was connected before. */
+EFI_STATUS
+connect_ring_port(xen_pfn_t base, evtchn_port_t remote_port)
+{
+    xen_pfn_t pfns[RING_PAGES];
+    EFI_STATUS status = EFI_DEVICE_ERROR;
+    int i;
+
+    if (!ring_info.evth)
+        return EFI_UNSUPPORTED;
+
+    pthread_mutex_lock(&ring_info.lock);
+
+    disconnect();
+
+    for (i = 0; i < RING_PAGES; i++)
+        pfns[i] = base + i;
+
+    ring_info.area = xenforeignmemory_map(ring_info.fmem, ring_info.domid,
+                                          PROT_READ | PROT_WRITE,
+                                          RING_PAGES, pfns, NULL);
+    if (!ring_info.area) {
+        ERR("Failed to map ring: %d, %s\n", errno, strerror(errno));
+        goto out;
+    }
+
+    ring_info.port = xenevtchn_bind_interdomain(ring_info.evth,
+                                                ring_info.domid,
+                                                remote_port);
+    if (ring_info.port < 0) {
+        ERR("Failed to bind ring evtchn: %d, %s\n", errno, strerror(errno));
+        disconnect();
+        goto out;
+    }
+
+    ring_init(&ring_info.rb, ring_info.area);
+    INFO("Ring connected at 0x%lx, evtchn %d\n", (unsigned long)base,
+         ring_info.port);
+    status = EFI_SUCCESS;
+
+out:
+    pthread_mutex_unlock(&ring_info.lock);
+    return status;
+}
+
+void
+ring_port_ready(void *opaque)
+{
+    xenevtchn_port_or_error_t port;
+
+    pthread_mutex_lock(&ring_info.lock);
+
+    while ((port = xenevtchn_pending(ring_info.evth)) >= 0) {
+        xenevtchn_unmask(ring_info.evth, port);
+        if (port != ring_info.port)
+            continue;
+
+        if (ring_process(&ring_info.rb))
+            xenevtchn_notify(ring_info.evth, port);
+
+        /* The guest has to set the ring up again with COMMAND_SETUP_RING. */
+        if (ring_info.rb.overflowed)
+            disconnect();
+    }
+
+    pthread_mutex_unlock(&ring_info.lock);
+}
+
+void
+teardown_ring_port(void)
+{
+    if (!ring_info.evth)
+        return;
+
+    disconnect();
+    xenevtchn_close(ring_info.evth);
+    ring_info.evth = NULL;
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <slab.h>
+
+#define SLAB_MIN_SHIFT 5
+#define SLAB_MAX_SHIFT 11
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_HDR 64 /* Header space at the start of each slab */
+
+/*
+ * Each slab is SLAB_SIZE aligned so that the slab owning a chunk can be found
+ * from the chunk address. Chunks are carved lazily so that untouched parts
+ * of a slab are never faulted in.
+ */
+struct slab {
+    struct slab *next;
+    void *free_list;
+    unsigned int cls;
+    unsigned int used;
+    unsigned int carved;
+    unsigned int nchunks;
+    bool draining;
+};
+
+static struct slab *slabs[SLAB_CLASSES];
+
+/* Set when a chunk is freed, as only then can a slab become sparse. */
+static bool chunk_freed;
+
+static unsigned int
+size_shift(size_t size)
+{
+    unsigned int shift = SLAB_MIN_SHIFT;
+
+    while (((size_t)1 << shift) < size)
+        shift++;
+
+    return shift;
+}
+
+static struct slab *
+slab_of(const void *p)
+{
+    return (struct slab *)((uintptr_t)p & ~((uintptr_t)SLAB_SIZE - 1));
+}
+
+static struct slab *
+slab_new(unsigned int cls)
+{
+    struct slab *s;
+    void *mem;
+
+    if (posix_memalign(&mem, SLAB_SIZE, SLAB_SIZE))
+        return NULL;
+
+    s = mem;
+    memset(s, 0, sizeof(*s));
+    s->cls = cls;
+    s->nchunks = (SLAB_SIZE - SLAB_HDR) >> (cls + SLAB_MIN_SHIFT);
+    s->next = slabs[cls];
+    slabs[cls] = s;
+
+    return s;
+}
+
+static void
+slab_release(struct slab *s)
+{
+    struct slab **pp;
+
+    for (pp = &slabs[s->cls]; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    free(s);
+}
+
+void *
+slab_alloc(size_t size, size_t *cap)
+{
+    unsigned int shift, cls;
+    struct slab *s;
+    void *p;
+
+    shift = size_shift(size);
+    if (shift > SLAB_MAX_SHIFT) {
+        p = malloc((size_t)1 << shift);
+        if (p)
+            *cap = (size_t)1 << shift;
+        return p;
+    }
+
+    cls = shift - SLAB_MIN_SHIFT;
+    for (s = slabs[cls]; s; s = s->next) {
+        if (!s->draining && (s->free_list || s->carved < s->nchunks))
+            break;
+    }
+    if (!s) {
+        s = slab_new(cls);
+        if (!s)
+            return NULL;
+    }
+
+    if (s->free_list) {
+        p = s->free_list;
+        s->free_list = *(void **)p;
+    } else {
+        p = (uint8_t *)s + SLAB_HDR + ((size_t)s->carved << shift);
+        s->carved++;
+    }
+    s->used++;
+    *cap = (size_t)1 << shift;
+
+    return p;
+}
+
+/*
+ * Grows the chunk p, of capacity cap, to hold at least size bytes, keeping
+ * the first used bytes. Capacities are powers of two, so growing a chunk
+ * one append at a time costs amortized time linear in the appended size.
+ * Chunks too large for the slabs are grown with realloc(), which can often
+ * extend them in place. On failure p is left untouched and NULL returned.
+ */
+void *
+slab_realloc(void *p, size_t cap, size_t used, size_t size, size_t *new_cap)
+{
+    unsigned int shift;
+    void *new;
+
+    if (size <= cap) {
+        *new_cap = cap;
+        return p;
+    }
+
+    shift = size_shift(size);
+    if (cap > SLAB_MAX_CHUNK) {
+        new = realloc(p, (size_t)1 << shift);
+        if (new)
+            *new_cap = (size_t)1 << shift;
+        return new;
+    }
+
+    new = slab_alloc(size, new_cap);
+    if (!new)
+        return NULL;
+    memcpy(new, p, used);
+    slab_free(p, cap);
+
+    return new;
+}
+
+void
+slab_free(void *p, size_t cap)
+{
+    struct slab *s;
+
+    if (!p)
+        return;
+
+    if (cap > SLAB_MAX_CHUNK) {
+        free(p);
+        return;
+    }
+
+    s = slab_of(p);
+    *(void **)p = s->free_list;
+    s->free_list = p;
+    s->used--;
+    chunk_freed = true;
+
+    /* Keep one slab per class around to avoid thrashing. */
+    if (!s->used && (s->draining || slabs[s->cls] != s || s->next))
+        slab_release(s);
+}
+
+/*
+ * Marks sparsely used slabs whose chunks fit in the free space of the other
+ * slabs of the same class as draining. No new chunks are handed out from a
+ * draining slab, so once the caller has moved everything returned as
+ * slab_draining() the slab is released. Returns false if there is nothing
+ * to do, which is always the case if no chunk was freed since the last call.
+ */
+bool
+slab_compact_begin(void)
+{
+    struct slab *s;
+    unsigned int cls, spare;
+    bool any = false;
+
+    if (!chunk_freed)
+        return false;
+    chunk_freed = false;
+
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        spare = 0;
+        for (s = slabs[cls]; s; s = s->next)
+            spare += s->nchunks - s->used;
+
+        for (s = slabs[cls]; s; s = s->next) {
+            if (s->used * 2 >= s->nchunks || spare < s->nchunks)
+                continue;
+            s->draining = true;
+            spare -= s->nchunks;
+            any = true;
+        }
+    }
+
+    return any;
+}
+
+bool
+slab_draining(const void *p, size_t cap)
+{
+    if (cap > SLAB_MAX_CHUNK)
+        return false;
+
+    return slab_of(p)->draining;
+}
+
+void
+slab_compact_end(void)
+{
+    struct slab *s;
+    unsigned int cls;
+
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        for (s = slabs[cls]; s; s = s->next)
+            s->draining = false;
+    }
+
+    /* Moving chunks out of the drained slabs doesn't make others sparse. */
+    chunk_freed = false;
+}
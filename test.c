@@ -33,6 +33,7 @@
 #include <glib.h>
 #include <openssl/pem.h>
 #include <assert.h>
+#include <ring.h>
 
 static char *save_name = "test.dat";
 
@@ -204,6 +205,9 @@ static void free_dstring(dstring *d)
 static enum backend_init_status testdb_init(void)
 {
     struct efi_variable *l;
+    uint8_t *name, *data;
+    UINTN name_len, data_len;
+    EFI_GUID guid;
     FILE *f = fopen(save_name, "r");
 
     if (!f) {
@@ -212,35 +216,43 @@ static enum backend_init_status testdb_init(void)
     }
 
     for (;;) {
-        UINTN name_len;
-
         if (fread(&name_len, sizeof name_len, 1, f) != 1)
             break;
 
-        l = malloc(sizeof *l);
+        name = malloc(name_len);
+        fread(name, 1, name_len, f);
+        fread(&data_len, sizeof data_len, 1, f);
+        data = malloc(data_len);
+        fread(data, 1, data_len, f);
+        fread(&guid, 1, GUID_LEN, f);
+
+        l = varstore_new(name, name_len, &guid, data, data_len);
         if (!l)
             abort();
+        free(name);
+        free(data);
 
-        l->name_len = name_len;
-        l->name = malloc(l->name_len);
-        fread(l->name, 1, l->name_len, f);
-        fread(&l->data_len, sizeof l->data_len, 1, f);
-        l->data = malloc(l->data_len);
-        fread(l->data, 1, l->data_len, f);
-        fread(&l->guid, 1, GUID_LEN, f);
         fread(&l->attributes, 1, sizeof l->attributes, f);
-        l->next = var_list;
-        var_list = l;
+        if (!varstore_insert(l))
+            abort();
     }
 
     fclose(f);
     return BACKEND_INIT_SUCCESS;
 }
 
+/* Set to make the backend fail to save, to exercise rollback. */
+static bool testdb_fail;
+
 static bool testdb_save(void)
 {
     struct efi_variable *l;
-    FILE *f = fopen(save_name, "w");
+    FILE *f;
+
+    if (testdb_fail)
+        return false;
+
+    f = fopen(save_name, "w");
 
     if (!f) {
         fprintf(stderr, "failed to open %s %s\n", save_name, strerror(errno));
@@ -335,17 +347,7 @@ static void free_globals(void)
 
 static void reset_vars(void)
 {
-    struct efi_variable *l, *tmp;
-
-    l = var_list;
-    while (l) {
-        tmp = l;
-        l = tmp->next;
-        free(tmp->name);
-        free(tmp->data);
-        free(tmp);
-    }
-    var_list = NULL;
+    varstore_clear();
 }
 
 static void call_get_variable(const dstring *name, const EFI_GUID *guid,
@@ -405,6 +407,22 @@ static void call_get_next_variable(UINTN avail, const dstring *name,
     dispatch_command(buf);
 }
 
+static void call_get_variable_names(UINT32 flags, const uint8_t *name,
+                                    UINTN name_len, const EFI_GUID *guid,
+                                    BOOLEAN at_runtime)
+{
+    uint8_t *ptr = buf;
+
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE_NAMES);
+    serialize_uint32(&ptr, flags);
+    serialize_data(&ptr, name, name_len);
+    serialize_guid(&ptr, guid);
+    *ptr++ = at_runtime;
+
+    dispatch_command(buf);
+}
+
 static void call_set_variable(const dstring *name, const EFI_GUID *guid,
                               const uint8_t *data, UINTN data_len,
                               UINT32 attr, BOOLEAN at_runtime)
@@ -940,6 +958,182 @@ static void test_query_variable_info(void)
     free_dstring(longname);
 }
 
+/* Appends a zeroed record of len bytes to a version 2 batch. */
+static uint8_t *batch_record(uint8_t **ptr, UINT32 len)
+{
+    uint8_t *rec;
+
+    serialize_uint32(ptr, len);
+    rec = *ptr;
+    memset(rec, 0, len);
+    *ptr += len;
+
+    return rec;
+}
+
+static void test_batch(void)
+{
+    uint8_t *ptr, *p, *rec[8], *data;
+    uint8_t big[256] = {0};
+    UINTN data_len;
+
+    reset_vars();
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+    sv_ok(tname2, &tguid2, big, sizeof(big), ATTR_B);
+
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, 8);
+
+    p = rec[0] = batch_record(&ptr, 128);
+    serialize_uint32(&p, COMMAND_SET_VARIABLE);
+    serialize_data(&p, (uint8_t *)tname4->data, dstring_data_size(tname4));
+    serialize_guid(&p, &tguid4);
+    serialize_data(&p, tdata4, sizeof(tdata4));
+    serialize_uint32(&p, ATTR_B);
+    *p = 0;
+
+    /* Records run in order so this sees the variable just set. */
+    p = rec[1] = batch_record(&ptr, 128);
+    serialize_uint32(&p, COMMAND_GET_VARIABLE);
+    serialize_data(&p, (uint8_t *)tname4->data, dstring_data_size(tname4));
+    serialize_guid(&p, &tguid4);
+    serialize_uintn(&p, 64);
+    *p = 0;
+
+    p = rec[2] = batch_record(&ptr, 128);
+    serialize_uint32(&p, COMMAND_GET_VARIABLE);
+    serialize_data(&p, (uint8_t *)tname1->data, dstring_data_size(tname1));
+    serialize_guid(&p, &tguid1);
+    serialize_uintn(&p, 1);
+    *p = 0;
+
+    p = rec[3] = batch_record(&ptr, 128);
+    serialize_uint32(&p, COMMAND_GET_NEXT_VARIABLE);
+    serialize_uintn(&p, 64);
+    serialize_data(&p, NULL, 0);
+    serialize_guid(&p, &nullguid);
+    *p = 0;
+
+    p = rec[4] = batch_record(&ptr, 32);
+    serialize_uint32(&p, COMMAND_QUERY_VARIABLE_INFO);
+    serialize_uint32(&p, 0);
+
+    p = rec[5] = batch_record(&ptr, 8);
+    serialize_uint32(&p, COMMAND_NOTIFY_SB_FAILURE);
+
+    /* The data would fit in the buffer asked for but not in the record. */
+    p = rec[6] = batch_record(&ptr, 128);
+    serialize_uint32(&p, COMMAND_GET_VARIABLE);
+    serialize_data(&p, (uint8_t *)tname2->data, dstring_data_size(tname2));
+    serialize_guid(&p, &tguid2);
+    serialize_uintn(&p, 4096);
+    *p = 0;
+
+    p = rec[7] = batch_record(&ptr, 16);
+    serialize_uint32(&p, COMMAND_QUERY_VARIABLE_INFO);
+    serialize_uint32(&p, 0);
+
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+
+    p = rec[0];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_SUCCESS);
+
+    p = rec[1];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&p), ==, ATTR_B);
+    data = unserialize_data(&p, &data_len, BSIZ);
+    g_assert_cmpuint(data_len, ==, sizeof(tdata4));
+    g_assert(!memcmp(data, tdata4, data_len));
+    free(data);
+
+    p = rec[2];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_BUFFER_TOO_SMALL);
+    g_assert_cmpuint(unserialize_uintn(&p), ==, sizeof(tdata1));
+
+    p = rec[3];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_SUCCESS);
+    data = unserialize_data(&p, &data_len, BSIZ);
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname1));
+    g_assert(!memcmp(data, tname1->data, data_len));
+    free(data);
+
+    p = rec[4];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uintn(&p), ==, TOTAL_LIMIT);
+
+    p = rec[5];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_UNSUPPORTED);
+
+    p = rec[6];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_BUFFER_TOO_SMALL);
+    g_assert_cmpuint(unserialize_uintn(&p), ==, sizeof(big));
+
+    p = rec[7];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_BUFFER_TOO_SMALL);
+
+    /* A malformed batch is rejected before any record is run. */
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, 2);
+    p = batch_record(&ptr, 128);
+    serialize_uint32(&p, COMMAND_SET_VARIABLE);
+    serialize_data(&p, (uint8_t *)tname5->data, dstring_data_size(tname5));
+    serialize_guid(&p, &tguid5);
+    serialize_data(&p, tdata5, sizeof(tdata5));
+    serialize_uint32(&p, ATTR_B);
+    *p = 0;
+    serialize_uint32(&ptr, sizeof(buf));
+
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_INVALID_PARAMETER);
+    call_get_variable(tname5, &tguid5, BSIZ, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_NOT_FOUND);
+
+    /*
+     * A truncated record reads zeros past its end, not what the previous
+     * record's response left behind, so it finds no name.
+     */
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, 2);
+    p = rec[0] = batch_record(&ptr, 128);
+    serialize_uint32(&p, COMMAND_GET_VARIABLE);
+    serialize_data(&p, (uint8_t *)tname1->data, dstring_data_size(tname1));
+    serialize_guid(&p, &tguid1);
+    serialize_uintn(&p, 64);
+    *p = 0;
+    p = rec[1] = batch_record(&ptr, 8);
+    serialize_uint32(&p, COMMAND_GET_VARIABLE);
+
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    p = rec[0];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_SUCCESS);
+    p = rec[1];
+    g_assert_cmpuint(unserialize_uintn(&p), ==, EFI_NOT_FOUND);
+
+    /* A record too short to hold a status rejects the batch. */
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, 1);
+    p = batch_record(&ptr, 4);
+    serialize_uint32(&p, COMMAND_QUERY_VARIABLE_INFO);
+
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_INVALID_PARAMETER);
+}
+
 static void test_get_next_variable_empty(void)
 {
     uint8_t *ptr;
@@ -981,7 +1175,8 @@ static void test_get_next_variable_only_runtime(void)
 
     /*
      * Insert a mixture of variables.
-     * Only runtime variables should be returned at runtime.
+     * Only runtime variables should be returned at runtime, ordered by GUID
+     * and then name.
      */
 
     reset_vars();
@@ -997,24 +1192,24 @@ static void test_get_next_variable_only_runtime(void)
     g_assert_cmpuint(status, ==, EFI_SUCCESS);
 
     data = unserialize_data(&ptr, &data_len, BSIZ);
-    g_assert_cmpuint(data_len, ==, dstring_data_size(tname4));
-    g_assert(!memcmp(tname4->data, data, data_len));
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname2));
+    g_assert(!memcmp(tname2->data, data, data_len));
     unserialize_guid(&ptr, &guid);
-    g_assert(!memcmp(&guid, &tguid4, GUID_LEN));
+    g_assert(!memcmp(&guid, &tguid2, GUID_LEN));
     free(data);
 
-    call_get_next_variable(BSIZ, tname4, &guid, 1);
+    call_get_next_variable(BSIZ, tname2, &guid, 1);
     ptr = buf;
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_SUCCESS);
     data = unserialize_data(&ptr, &data_len, BSIZ);
-    g_assert_cmpuint(data_len, ==, dstring_data_size(tname2));
-    g_assert(!memcmp(tname2->data, data, data_len));
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname4));
+    g_assert(!memcmp(tname4->data, data, data_len));
     unserialize_guid(&ptr, &guid);
-    g_assert(!memcmp(&guid, &tguid2, GUID_LEN));
+    g_assert(!memcmp(&guid, &tguid4, GUID_LEN));
     free(data);
 
-    call_get_next_variable(BSIZ, tname2, &guid, 1);
+    call_get_next_variable(BSIZ, tname4, &guid, 1);
     ptr = buf;
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_NOT_FOUND);
@@ -1058,10 +1253,10 @@ static void test_get_next_variable_no_match(void)
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_SUCCESS);
     data = unserialize_data(&ptr, &data_len, BSIZ);
-    g_assert_cmpuint(data_len, ==, dstring_data_size(tname2));
-    g_assert(!memcmp(tname2->data, data, data_len));
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname1));
+    g_assert(!memcmp(tname1->data, data, data_len));
     unserialize_guid(&ptr, &guid);
-    g_assert(!memcmp(&guid, &tguid2, GUID_LEN));
+    g_assert(!memcmp(&guid, &tguid1, GUID_LEN));
 
     /* Check when an incorrect name is passed in. */
     call_get_next_variable(BSIZ, tname4, &guid, 0);
@@ -1070,7 +1265,7 @@ static void test_get_next_variable_no_match(void)
     g_assert_cmpuint(status, ==, EFI_INVALID_PARAMETER);
 
     /* Check when an incorrect guid is passed in. */
-    call_get_next_variable(BSIZ, tname2, &tguid4, 0);
+    call_get_next_variable(BSIZ, tname1, &tguid4, 0);
     ptr = buf;
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_INVALID_PARAMETER);
@@ -1078,6 +1273,292 @@ static void test_get_next_variable_no_match(void)
     free(data);
 }
 
+static void check_name_entry(uint8_t **ptr, const dstring *name,
+                             const EFI_GUID *guid, UINT32 attr,
+                             UINTN data_len)
+{
+    EFI_GUID got_guid;
+    uint8_t *data;
+    UINTN len;
+
+    unserialize_guid(ptr, &got_guid);
+    g_assert(!memcmp(&got_guid, guid, GUID_LEN));
+    data = unserialize_data(ptr, &len, NAME_LIMIT);
+    g_assert_cmpuint(len, ==, dstring_data_size(name));
+    g_assert(!memcmp(data, name->data, len));
+    free(data);
+    g_assert_cmpuint(unserialize_uint32(ptr), ==, attr);
+    g_assert_cmpuint(unserialize_uintn(ptr), ==, data_len);
+}
+
+static void test_get_variable_names(void)
+{
+    uint8_t *ptr, *data, *name, big[40000];
+    UINTN data_len, name_len;
+    EFI_GUID guid;
+    UINT32 count;
+    int i;
+
+    reset_vars();
+    sv_ok(tname5, &tguid5, tdata5, sizeof(tdata5), ATTR_B);
+    sv_ok(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_BR);
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BR);
+    sv_ok(tname3, &tguid3, tdata3, sizeof(tdata3), ATTR_B);
+
+    /* Everything at boot time, in GetNextVariableName order. */
+    call_get_variable_names(0, NULL, 0, &nullguid, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, 5);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, 0);
+    check_name_entry(&ptr, tname1, &tguid1, ATTR_B, sizeof(tdata1));
+    check_name_entry(&ptr, tname2, &tguid2, ATTR_BR, sizeof(tdata2));
+    check_name_entry(&ptr, tname5, &tguid5, ATTR_B, sizeof(tdata5));
+    check_name_entry(&ptr, tname3, &tguid3, ATTR_B, sizeof(tdata3));
+    check_name_entry(&ptr, tname4, &tguid4, ATTR_BR, sizeof(tdata4));
+
+    /* Continue from a token, with payloads. */
+    call_get_variable_names(GET_NAMES_WITH_DATA, (uint8_t *)tname5->data,
+                            dstring_data_size(tname5), &tguid5, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, 2);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, 0);
+    check_name_entry(&ptr, tname3, &tguid3, ATTR_B, sizeof(tdata3));
+    data = unserialize_data(&ptr, &data_len, BSIZ);
+    g_assert_cmpuint(data_len, ==, sizeof(tdata3));
+    g_assert(!memcmp(data, tdata3, data_len));
+    free(data);
+    check_name_entry(&ptr, tname4, &tguid4, ATTR_BR, sizeof(tdata4));
+    data = unserialize_data(&ptr, &data_len, BSIZ);
+    g_assert_cmpuint(data_len, ==, sizeof(tdata4));
+    g_assert(!memcmp(data, tdata4, data_len));
+    free(data);
+
+    /* Only runtime variables at runtime, and no payloads. */
+    call_get_variable_names(0, NULL, 0, &nullguid, 1);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, 2);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, 0);
+    check_name_entry(&ptr, tname2, &tguid2, ATTR_BR, sizeof(tdata2));
+    check_name_entry(&ptr, tname4, &tguid4, ATTR_BR, sizeof(tdata4));
+
+    call_get_variable_names(GET_NAMES_WITH_DATA, NULL, 0, &nullguid, 1);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_INVALID_PARAMETER);
+
+    /* Payloads that overflow the buffer are split across calls. */
+    reset_vars();
+    memset(big, 0xab, sizeof(big));
+    sv_ok(tname1, &tguid1, big, sizeof(big), ATTR_B);
+    sv_ok(tname3, &tguid3, big, sizeof(big), ATTR_B);
+
+    name = NULL;
+    name_len = 0;
+    memset(&guid, 0, sizeof(guid));
+    for (i = 0; i < 2; i++) {
+        call_get_variable_names(GET_NAMES_WITH_DATA, name, name_len, &guid, 0);
+        free(name);
+        ptr = buf;
+        g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+        count = unserialize_uint32(&ptr);
+        g_assert_cmpuint(count, ==, 1);
+        g_assert_cmpuint(unserialize_uint32(&ptr), ==, i == 0);
+        unserialize_guid(&ptr, &guid);
+        name = unserialize_data(&ptr, &name_len, NAME_LIMIT);
+        unserialize_uint32(&ptr); /* attr */
+        g_assert_cmpuint(unserialize_uintn(&ptr), ==, sizeof(big));
+        data = unserialize_data(&ptr, &data_len, DATA_LIMIT);
+        g_assert_cmpuint(data_len, ==, sizeof(big));
+        g_assert(!memcmp(data, big, data_len));
+        free(data);
+    }
+    g_assert(!memcmp(&guid, &tguid3, GUID_LEN));
+    free(name);
+}
+
+#define CONCURRENT_READERS 4
+#define CONCURRENT_ITERATIONS 1000
+
+/*
+ * Repeatedly reads tname1 on a private buffer, counting any result that is
+ * not exactly one of the two values the writer alternates between.
+ */
+static void *concurrent_reader(void *arg)
+{
+    unsigned int *failures = arg;
+    uint8_t *rbuf, *ptr, *data;
+    UINTN data_len;
+    EFI_STATUS status;
+    int i;
+
+    rbuf = malloc(SHMEM_SIZE);
+    g_assert(rbuf);
+
+    for (i = 0; i < CONCURRENT_ITERATIONS; i++) {
+        ptr = rbuf;
+        serialize_uint32(&ptr, 1);
+        serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE);
+        serialize_data(&ptr, (uint8_t *)tname1->data, dstring_data_size(tname1));
+        serialize_guid(&ptr, &tguid1);
+        serialize_uintn(&ptr, BSIZ);
+        *ptr++ = 0;
+
+        dispatch_command(rbuf);
+
+        ptr = rbuf;
+        status = unserialize_uintn(&ptr);
+        if (status != EFI_SUCCESS) {
+            (*failures)++;
+            continue;
+        }
+        unserialize_uint32(&ptr); /* attr */
+        data = unserialize_data(&ptr, &data_len, BSIZ);
+        if (!((data_len == sizeof(tdata1) && !memcmp(data, tdata1, data_len)) ||
+              (data_len == sizeof(tdata2) && !memcmp(data, tdata2, data_len))))
+            (*failures)++;
+        free(data);
+    }
+
+    free(rbuf);
+    free_request_arena();
+    return NULL;
+}
+
+static void test_concurrent_access(void)
+{
+    pthread_t threads[CONCURRENT_READERS];
+    unsigned int failures[CONCURRENT_READERS] = {0};
+    int i;
+
+    reset_vars();
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+
+    for (i = 0; i < CONCURRENT_READERS; i++)
+        g_assert_cmpint(pthread_create(&threads[i], NULL, concurrent_reader,
+                                       &failures[i]), ==, 0);
+
+    for (i = 0; i < CONCURRENT_ITERATIONS; i++) {
+        if (i % 2) {
+            sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+        } else {
+            sv_ok(tname1, &tguid1, tdata2, sizeof(tdata2), ATTR_B);
+        }
+    }
+
+    for (i = 0; i < CONCURRENT_READERS; i++) {
+        pthread_join(threads[i], NULL);
+        g_assert_cmpuint(failures[i], ==, 0);
+    }
+}
+
+static void ring_queue(struct varstore_sring *sring, uint32_t id,
+                       uint32_t slot)
+{
+    struct varstore_ring_entry *e;
+
+    e = &sring->req[sring->req_prod & (RING_ENTRIES - 1)];
+    e->id = id;
+    e->slot = slot;
+    sring->req_prod++;
+}
+
+/* Drives the ring against a buffer standing in for the guest's memory. */
+static void test_ring(void)
+{
+    struct ring_backend rb;
+    struct varstore_sring *sring;
+    uint8_t *area, *slot, *ptr, *data;
+    UINTN data_len;
+
+    reset_vars();
+
+    area = calloc(1, RING_SIZE);
+    g_assert(area);
+    sring = (struct varstore_sring *)area;
+    sring->req_event = 1;
+    sring->rsp_event = 1;
+    ring_init(&rb, area);
+
+    g_assert_false(ring_process(&rb));
+    g_assert_cmpuint(sring->rsp_prod, ==, 0);
+
+    ptr = slot = area + PAGE_SIZE;
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, (UINT32)COMMAND_SET_VARIABLE);
+    serialize_data(&ptr, (uint8_t *)tname1->data, dstring_data_size(tname1));
+    serialize_guid(&ptr, &tguid1);
+    serialize_data(&ptr, tdata1, sizeof(tdata1));
+    serialize_uint32(&ptr, ATTR_B);
+    *ptr++ = 0;
+    ring_queue(sring, 10, 0);
+
+    ptr = area + PAGE_SIZE + SHMEM_SIZE;
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE);
+    serialize_data(&ptr, (uint8_t *)tname1->data, dstring_data_size(tname1));
+    serialize_guid(&ptr, &tguid1);
+    serialize_uintn(&ptr, BSIZ);
+    *ptr++ = 0;
+    ring_queue(sring, 11, 1);
+
+    /* Requests run in order and are answered in place. */
+    g_assert_true(ring_process(&rb));
+    g_assert_cmpuint(sring->rsp_prod, ==, 2);
+    g_assert_cmpuint(sring->req_event, ==, 3);
+    g_assert_cmpuint(sring->rsp[0].id, ==, 10);
+    g_assert_cmpuint(sring->rsp[0].slot, ==, 0);
+    g_assert_cmpuint(sring->rsp[1].id, ==, 11);
+    g_assert_cmpuint(sring->rsp[1].slot, ==, 1);
+
+    ptr = slot;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+
+    ptr = area + PAGE_SIZE + SHMEM_SIZE;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, ATTR_B);
+    data = unserialize_data(&ptr, &data_len, BSIZ);
+    g_assert_cmpuint(data_len, ==, sizeof(tdata1));
+    g_assert(!memcmp(data, tdata1, data_len));
+    free(data);
+
+    /*
+     * A bad slot is answered without running anything, and there is no
+     * notification since the guest has not consumed the earlier responses.
+     */
+    ring_queue(sring, 12, RING_SLOTS);
+    g_assert_false(ring_process(&rb));
+    g_assert_cmpuint(sring->rsp_prod, ==, 3);
+    g_assert_cmpuint(sring->rsp[2].id, ==, 12);
+
+    /*
+     * Nor does a guest that has queued too much get anything run, even once
+     * it stops, until the ring is set up again.
+     */
+    sring->req_prod += RING_ENTRIES + 1;
+    g_assert_false(ring_process(&rb));
+    g_assert_true(rb.overflowed);
+    g_assert_cmpuint(sring->rsp_prod, ==, 3);
+
+    sring->req_prod = rb.req_cons + 1;
+    g_assert_false(ring_process(&rb));
+    g_assert_cmpuint(sring->rsp_prod, ==, 3);
+
+    memset(sring, 0, sizeof(*sring));
+    sring->req_event = 1;
+    sring->rsp_event = 1;
+    ring_init(&rb, area);
+    g_assert_false(rb.overflowed);
+    ring_queue(sring, 13, RING_SLOTS);
+    g_assert_true(ring_process(&rb));
+    g_assert_cmpuint(sring->rsp_prod, ==, 1);
+    g_assert_cmpuint(sring->rsp[0].id, ==, 13);
+
+    free(area);
+}
+
 static void test_get_next_variable_all(void)
 {
     uint8_t *ptr, *data;
@@ -1087,7 +1568,8 @@ static void test_get_next_variable_all(void)
 
     /*
      * Insert a mixture of variables.
-     * At boot time, all variables should be retrieved.
+     * At boot time, all variables should be retrieved, ordered by GUID and
+     * then name regardless of insertion order.
      */
 
     reset_vars();
@@ -1102,57 +1584,57 @@ static void test_get_next_variable_all(void)
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_SUCCESS);
     data = unserialize_data(&ptr, &data_len, BSIZ);
-    g_assert_cmpuint(data_len, ==, dstring_data_size(tname3));
-    g_assert(!memcmp(tname3->data, data, data_len));
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname1));
+    g_assert(!memcmp(tname1->data, data, data_len));
     unserialize_guid(&ptr, &guid);
-    g_assert(!memcmp(&guid, &tguid3, GUID_LEN));
+    g_assert(!memcmp(&guid, &tguid1, GUID_LEN));
 
-    call_get_next_variable(BSIZ, tname3, &guid, 0);
+    call_get_next_variable(BSIZ, tname1, &guid, 0);
     free(data);
     ptr = buf;
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_SUCCESS);
     data = unserialize_data(&ptr, &data_len, BSIZ);
-    g_assert_cmpuint(data_len, ==, dstring_data_size(tname4));
-    g_assert(!memcmp(tname4->data, data, data_len));
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname2));
+    g_assert(!memcmp(tname2->data, data, data_len));
     unserialize_guid(&ptr, &guid);
-    g_assert(!memcmp(&guid, &tguid4, GUID_LEN));
+    g_assert(!memcmp(&guid, &tguid2, GUID_LEN));
     free(data);
 
-    call_get_next_variable(BSIZ, tname4, &guid, 0);
+    call_get_next_variable(BSIZ, tname2, &guid, 0);
     ptr = buf;
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_SUCCESS);
     data = unserialize_data(&ptr, &data_len, BSIZ);
-    g_assert_cmpuint(data_len, ==, dstring_data_size(tname1));
-    g_assert(!memcmp(tname1->data, data, data_len));
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname5));
+    g_assert(!memcmp(tname5->data, data, data_len));
     unserialize_guid(&ptr, &guid);
-    g_assert(!memcmp(&guid, &tguid1, GUID_LEN));
+    g_assert(!memcmp(&guid, &tguid5, GUID_LEN));
 
-    call_get_next_variable(BSIZ, tname1, &guid, 0);
+    call_get_next_variable(BSIZ, tname5, &guid, 0);
 
     free(data);
     ptr = buf;
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_SUCCESS);
     data = unserialize_data(&ptr, &data_len, BSIZ);
-    g_assert_cmpuint(data_len, ==, dstring_data_size(tname2));
-    g_assert(!memcmp(tname2->data, data, data_len));
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname3));
+    g_assert(!memcmp(tname3->data, data, data_len));
     unserialize_guid(&ptr, &guid);
-    g_assert(!memcmp(&guid, &tguid2, GUID_LEN));
+    g_assert(!memcmp(&guid, &tguid3, GUID_LEN));
     free(data);
 
-    call_get_next_variable(BSIZ, tname2, &guid, 0);
+    call_get_next_variable(BSIZ, tname3, &guid, 0);
     ptr = buf;
     status = unserialize_uintn(&ptr);
     g_assert_cmpuint(status, ==, EFI_SUCCESS);
     data = unserialize_data(&ptr, &data_len, BSIZ);
-    g_assert_cmpuint(data_len, ==, dstring_data_size(tname5));
-    g_assert(!memcmp(tname5->data, data, data_len));
+    g_assert_cmpuint(data_len, ==, dstring_data_size(tname4));
+    g_assert(!memcmp(tname4->data, data, data_len));
     unserialize_guid(&ptr, &guid);
-    g_assert(!memcmp(&guid, &tguid5, GUID_LEN));
+    g_assert(!memcmp(&guid, &tguid4, GUID_LEN));
 
-    call_get_next_variable(BSIZ, tname5, &guid, 0);
+    call_get_next_variable(BSIZ, tname4, &guid, 0);
     free(data);
     ptr = buf;
     status = unserialize_uintn(&ptr);
@@ -1561,9 +2043,316 @@ static void test_set_variable_many_vars(void)
         else
             g_assert_cmpuint(status, ==, EFI_SUCCESS);
     }
+
+    /* Delete every other variable and check the rest can still be found. */
+    for (i = 0; i < count; i += 2) {
+        sprintf(name, "%04d", i);
+        call_set_variable(dname, &tguid1, NULL, 0, ATTR_B, 0);
+        ptr = buf;
+        status = unserialize_uintn(&ptr);
+        g_assert_cmpuint(status, ==, EFI_SUCCESS);
+    }
+    for (i = 0; i < count; i++) {
+        sprintf(name, "%04d", i);
+        call_get_variable(dname, &tguid1, BSIZ, 0);
+        ptr = buf;
+        status = unserialize_uintn(&ptr);
+        g_assert_cmpuint(status, ==, i % 2 ? EFI_SUCCESS : EFI_NOT_FOUND);
+    }
+    free_dstring(dname);
+}
+
+/* Check a partition's chain and totals against a walk of var_list. */
+static void check_partition(enum var_partition p, UINT32 mask, UINT32 match)
+{
+    struct efi_variable *l;
+    uint64_t bytes = 0;
+    size_t count = 0;
+
+    for (l = var_list; l; l = l->next) {
+        if ((l->attributes & mask) != match)
+            continue;
+        bytes += l->name_len + l->data_len + VARIABLE_SIZE_OVERHEAD;
+        count++;
+    }
+    g_assert_cmpuint(varstore_usage(p)->bytes, ==, bytes);
+    g_assert_cmpuint(varstore_usage(p)->count, ==, count);
+
+    for (l = varstore_first(p); l; l = l->part[p].next) {
+        g_assert_cmpuint(l->attributes & mask, ==, match);
+        count--;
+    }
+    g_assert_cmpuint(count, ==, 0);
+}
+
+static void check_partitions(void)
+{
+    check_partition(VAR_PART_NV, EFI_VARIABLE_NON_VOLATILE,
+                    EFI_VARIABLE_NON_VOLATILE);
+    check_partition(VAR_PART_VOLATILE, EFI_VARIABLE_NON_VOLATILE, 0);
+    check_partition(VAR_PART_RUNTIME, EFI_VARIABLE_RUNTIME_ACCESS,
+                    EFI_VARIABLE_RUNTIME_ACCESS);
+}
+
+static void test_set_variable_partitions(void)
+{
+    remove(save_name);
+    reset_vars();
+    check_partitions();
+
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    sv_ok(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_B);
+    sv_ok(tname3, &tguid3, tdata3, sizeof(tdata3), ATTR_BRNV);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BR);
+    check_partitions();
+
+    /* Update */
+    sv_ok(tname1, &tguid1, tdata5, sizeof(tdata5), ATTR_BNV);
+    sv_ok(tname4, &tguid4, tdata1, sizeof(tdata1), ATTR_BR);
+    check_partitions();
+
+    /* Append */
+    sv_ok(tname3, &tguid3, tdata4, sizeof(tdata4),
+          ATTR_BRNV | EFI_VARIABLE_APPEND_WRITE);
+    check_partitions();
+
+    /* Delete */
+    sv_ok(tname2, &tguid2, NULL, 0, ATTR_B);
+    sv_ok(tname3, &tguid3, NULL, 0, ATTR_BRNV);
+    check_partitions();
+
+    /* Reload */
+    reset_vars();
+    db->init();
+    check_partitions();
+    g_assert_cmpuint(varstore_usage(VAR_PART_VOLATILE)->count, ==, 0);
+    g_assert_cmpuint(varstore_usage(VAR_PART_NV)->count, ==, 1);
+}
+
+static void test_set_variable_compact(void)
+{
+    uint8_t *ptr, *data;
+    EFI_STATUS status;
+    UINTN data_len;
+    int i;
+    uint8_t big[300];
+    dstring *dname = alloc_dstring_unset(5);
+    char *name = (char *)dname->data;
+
+    reset_vars();
+    memset(big, 0xab, sizeof(big));
+
+    /* Fill several slabs, with every fourth variable's data out of line. */
+    for (i = 0; i < 400; i++) {
+        sprintf(name, "%04d", i);
+        big[0] = i;
+        sv_ok(dname, &tguid1, big, i % 4 ? 1 : sizeof(big), ATTR_B);
+    }
+
+    /* Deleting most of them leaves sparse slabs to be compacted. */
+    for (i = 0; i < 400; i++) {
+        if (i % 8 == 0)
+            continue;
+        sprintf(name, "%04d", i);
+        sv_ok(dname, &tguid1, NULL, 0, ATTR_B);
+    }
+    varstore_compact();
+    check_partitions();
+
+    for (i = 0; i < 400; i += 8) {
+        sprintf(name, "%04d", i);
+        call_get_variable(dname, &tguid1, BSIZ, 0);
+        ptr = buf;
+        status = unserialize_uintn(&ptr);
+        g_assert_cmpuint(status, ==, EFI_SUCCESS);
+        g_assert_cmpuint(unserialize_uint32(&ptr), ==, ATTR_B);
+        data = unserialize_data(&ptr, &data_len, BSIZ);
+        g_assert_cmpuint(data_len, ==, sizeof(big));
+        g_assert_cmpuint(data[0], ==, (uint8_t)i);
+        g_assert(!memcmp(data + 1, big + 1, data_len - 1));
+        free(data);
+    }
     free_dstring(dname);
 }
 
+static void test_set_variable_append_grow(void)
+{
+    struct efi_variable *l;
+    uint8_t chunk[500];
+    int i;
+
+    reset_vars();
+
+    /*
+     * Grow a variable one append at a time across the inline, slab and
+     * malloc backed capacities, checking that earlier data is kept.
+     */
+    for (i = 0; i < 100; i++) {
+        memset(chunk, i, sizeof(chunk));
+        sv_ok(tname1, &tguid1, chunk, sizeof(chunk),
+              ATTR_BNV | EFI_VARIABLE_APPEND_WRITE);
+    }
+
+    l = varstore_lookup((uint8_t *)tname1->data, dstring_data_size(tname1),
+                        &tguid1);
+    g_assert_nonnull(l);
+    g_assert_cmpuint(l->data_len, ==, 100 * sizeof(chunk));
+    for (i = 0; i < 100; i++) {
+        memset(chunk, i, sizeof(chunk));
+        g_assert(!memcmp(l->data + i * sizeof(chunk), chunk, sizeof(chunk)));
+    }
+    check_partitions();
+}
+
+static void check_var_data(dstring *name, const EFI_GUID *guid,
+                           const uint8_t *expected, UINTN expected_len)
+{
+    uint8_t *ptr, *data;
+    UINTN data_len;
+
+    call_get_variable(name, guid, BSIZ, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    unserialize_uint32(&ptr);
+    data = unserialize_data(&ptr, &data_len, BSIZ);
+    g_assert_cmpuint(data_len, ==, expected_len);
+    g_assert(!memcmp(data, expected, data_len));
+    free(data);
+}
+
+static void test_set_variable_rollback(void)
+{
+    uint8_t *ptr;
+    uint8_t big[1000], big2[600];
+
+    reset_vars();
+    memset(big, 0xab, sizeof(big));
+    memset(big2, 0xcd, sizeof(big2));
+
+    /* One variable with inline data and one with data out of line. */
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    sv_ok(tname2, &tguid2, big, sizeof(big), ATTR_BNV);
+
+    testdb_fail = true;
+
+    /* Failed updates leave the old data in place. */
+    call_set_variable(tname1, &tguid1, big2, sizeof(big2), ATTR_BNV, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+    call_set_variable(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_BNV, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+    check_var_data(tname1, &tguid1, tdata1, sizeof(tdata1));
+    check_var_data(tname2, &tguid2, big, sizeof(big));
+
+    /* Failed appends are truncated again. */
+    call_set_variable(tname1, &tguid1, big2, sizeof(big2),
+                      ATTR_BNV | EFI_VARIABLE_APPEND_WRITE, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+    call_set_variable(tname2, &tguid2, big2, sizeof(big2),
+                      ATTR_BNV | EFI_VARIABLE_APPEND_WRITE, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+    check_var_data(tname1, &tguid1, tdata1, sizeof(tdata1));
+    check_var_data(tname2, &tguid2, big, sizeof(big));
+
+    /* Failed deletes put the variable back. */
+    call_set_variable(tname2, &tguid2, NULL, 0, ATTR_BNV, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+    check_var_data(tname2, &tguid2, big, sizeof(big));
+    check_partitions();
+
+    testdb_fail = false;
+
+    /* The variables can still be changed afterwards. */
+    sv_ok(tname2, &tguid2, big2, sizeof(big2), ATTR_BNV);
+    check_var_data(tname2, &tguid2, big2, sizeof(big2));
+    check_partitions();
+}
+
+static unsigned int flush_count;
+
+static bool counting_flush(void)
+{
+    flush_count++;
+    return !testdb_fail;
+}
+
+static void set_var(dstring *name, const EFI_GUID *guid,
+                    const uint8_t *data, UINTN data_len, UINT32 attr)
+{
+    EFI_STATUS status;
+
+    status = internal_set_variable((uint8_t *)name->data,
+                                   dstring_data_size(name), guid,
+                                   data, data_len, attr);
+    g_assert_cmpuint(status, ==, EFI_SUCCESS);
+}
+
+static struct efi_variable *find_var(dstring *name, const EFI_GUID *guid)
+{
+    return varstore_lookup((uint8_t *)name->data, dstring_data_size(name),
+                           guid);
+}
+
+static void test_set_variable_transaction(void)
+{
+    size_t mark;
+
+    reset_vars();
+    flush_count = 0;
+
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    sv_ok(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_BNV);
+
+    /* Several changes are saved with a single flush. */
+    varstore_begin();
+    set_var(tname3, &tguid3, tdata3, sizeof(tdata3), ATTR_BNV);
+    set_var(tname1, &tguid1, tdata2, sizeof(tdata2), ATTR_BNV);
+    g_assert(varstore_remove(find_var(tname2, &tguid2)));
+    g_assert(varstore_commit(counting_flush));
+    g_assert_cmpuint(flush_count, ==, 1);
+    check_var_data(tname1, &tguid1, tdata2, sizeof(tdata2));
+    check_var_data(tname3, &tguid3, tdata3, sizeof(tdata3));
+    g_assert_null(find_var(tname2, &tguid2));
+
+    /* Changing only volatile variables does not flush. */
+    varstore_begin();
+    set_var(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_B);
+    g_assert(varstore_commit(counting_flush));
+    g_assert_cmpuint(flush_count, ==, 1);
+
+    /* A failed flush undoes every change in the transaction. */
+    testdb_fail = true;
+    varstore_begin();
+    set_var(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    set_var(tname4, &tguid4, tdata1, sizeof(tdata1), ATTR_B);
+    set_var(tname5, &tguid5, tdata5, sizeof(tdata5), ATTR_BNV);
+    g_assert(varstore_remove(find_var(tname3, &tguid3)));
+    g_assert(!varstore_commit(counting_flush));
+    g_assert_cmpuint(flush_count, ==, 2);
+    testdb_fail = false;
+    check_var_data(tname1, &tguid1, tdata2, sizeof(tdata2));
+    check_var_data(tname3, &tguid3, tdata3, sizeof(tdata3));
+    check_var_data(tname4, &tguid4, tdata4, sizeof(tdata4));
+    g_assert_null(find_var(tname5, &tguid5));
+    check_partitions();
+
+    /* Aborting a nested transaction only undoes its own changes. */
+    varstore_begin();
+    set_var(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    mark = varstore_begin();
+    set_var(tname3, &tguid3, tdata1, sizeof(tdata1), ATTR_BNV);
+    varstore_abort(mark);
+    g_assert(varstore_commit(counting_flush));
+    g_assert_cmpuint(flush_count, ==, 3);
+    check_var_data(tname1, &tguid1, tdata1, sizeof(tdata1));
+    check_var_data(tname3, &tguid3, tdata3, sizeof(tdata3));
+    check_partitions();
+}
+
 static void test_set_variable_non_volatile(void)
 {
     uint8_t *ptr, *data;
@@ -2635,6 +3424,119 @@ static void test_secure_set_dbt_usermode(void)
     test_secure_set_db__usermode(dbt_name);
 }
 
+/*
+ * Appends to db and dbx are deduplicated against everything already in the
+ * same database, including entries added by earlier appends, and not against
+ * the other database.
+ */
+static void test_secure_append_dedup(void)
+{
+    EFI_TIME test_time = {2018, 6, 20, 13, 38, 0, 0, 0, 0, 0, 0};
+    char *certs_BA[] = {"testcertB.pem", "testcertA.pem", NULL};
+    EFI_SIGNATURE_LIST *combined_cert;
+    size_t combined_len;
+    uint8_t *ptr, *data;
+    UINTN data_len;
+    const UINT32 attr = ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE;
+
+    reset_vars();
+    setup_variables();
+    set_usermode();
+
+    sign_and_check(db_name, &gEfiImageSecurityDatabaseGuid, ATTR_BRNV_TIME,
+                   &test_time, (uint8_t *)certA, certA_len,
+                   &sign_testPK, EFI_SUCCESS);
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid, ATTR_BRNV_TIME,
+                   &test_time, (uint8_t *)certB, certB_len,
+                   &sign_testPK, EFI_SUCCESS);
+
+    test_time.Second++;
+    sign_and_check(db_name, &gEfiImageSecurityDatabaseGuid, attr, &test_time,
+                   (uint8_t *)certB, certB_len, &sign_testPK, EFI_SUCCESS);
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid, attr, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_testPK, EFI_SUCCESS);
+
+    /* Duplicates of the original and of the appended entries. */
+    test_time.Second++;
+    sign_and_check(db_name, &gEfiImageSecurityDatabaseGuid, attr, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_testPK, EFI_SUCCESS);
+    sign_and_check(db_name, &gEfiImageSecurityDatabaseGuid, attr, &test_time,
+                   (uint8_t *)certB, certB_len, &sign_testPK, EFI_SUCCESS);
+    read_x509_list_into_CertList(certs_BA, &combined_cert, &combined_len);
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid, attr, &test_time,
+                   (uint8_t *)combined_cert, combined_len,
+                   &sign_testPK, EFI_SUCCESS);
+
+    /* A new entry after the duplicates is still added. */
+    test_time.Second++;
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid, attr, &test_time,
+                   (uint8_t *)certPK, certPK_len, &sign_testPK, EFI_SUCCESS);
+
+    call_get_variable(db_name, &gEfiImageSecurityDatabaseGuid,
+                      certA_len + certB_len, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, ATTR_BRNV_TIME);
+    data = unserialize_data(&ptr, &data_len, certA_len + certB_len);
+    g_assert_cmpuint(data_len, ==, certA_len + certB_len);
+    assert_cmpmem(data, certA_len, certA, certA_len);
+    assert_cmpmem(data + certA_len, certB_len, certB, certB_len);
+    free(data);
+
+    call_get_variable(dbx_name, &gEfiImageSecurityDatabaseGuid,
+                      certA_len + certB_len + certPK_len, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, ATTR_BRNV_TIME);
+    data = unserialize_data(&ptr, &data_len,
+                            certA_len + certB_len + certPK_len);
+    g_assert_cmpuint(data_len, ==, certA_len + certB_len + certPK_len);
+    assert_cmpmem(data, certB_len, certB, certB_len);
+    assert_cmpmem(data + certB_len, certA_len, certA, certA_len);
+    assert_cmpmem(data + certB_len + certA_len, certPK_len,
+                  certPK, certPK_len);
+    free(data);
+
+    free(combined_cert);
+}
+
+/*
+ * Replaying an identical signed update gives the same result, until the keys
+ * that it was verified against change.
+ */
+static void test_secure_set_replay(void)
+{
+    EFI_TIME test_time = {2018, 6, 20, 13, 38, 0, 0, 0, 0, 0, 0};
+    EFI_TIME kek_time = test_time;
+
+    reset_vars();
+    setup_variables();
+    set_usermode();
+
+    sign_and_check(KEK_name, &gEfiGlobalVariableGuid, ATTR_BRNV_TIME,
+                   &kek_time, (uint8_t *)certB, certB_len,
+                   &sign_testPK, EFI_SUCCESS);
+
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid,
+                   ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_certB, EFI_SUCCESS);
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid,
+                   ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_certB, EFI_SUCCESS);
+    check_variable_data(dbx_name, &gEfiImageSecurityDatabaseGuid, BSIZ, 0,
+                        (uint8_t *)certA, certA_len);
+
+    /* certB is no longer a KEK so the same update is now rejected. */
+    kek_time.Second++;
+    sign_and_check(KEK_name, &gEfiGlobalVariableGuid, ATTR_BRNV_TIME,
+                   &kek_time, (uint8_t *)certPK, certPK_len,
+                   &sign_testPK, EFI_SUCCESS);
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid,
+                   ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_certB,
+                   EFI_SECURITY_VIOLATION);
+}
+
 int main(int argc, char **argv)
 {
     int r;
@@ -2656,6 +3558,8 @@ int main(int argc, char **argv)
                     test_get_variable_too_small);
     g_test_add_func("/test/query_variable_info",
                     test_query_variable_info);
+    g_test_add_func("/test/batch",
+                    test_batch);
     g_test_add_func("/test/get_next_variable/empty",
                     test_get_next_variable_empty);
     g_test_add_func("/test/get_next_variable/long_name",
@@ -2666,6 +3570,12 @@ int main(int argc, char **argv)
                     test_get_next_variable_too_small);
     g_test_add_func("/test/get_next_variable/no_match",
                     test_get_next_variable_no_match);
+    g_test_add_func("/test/concurrent_access",
+                    test_concurrent_access);
+    g_test_add_func("/test/get_variable_names",
+                    test_get_variable_names);
+    g_test_add_func("/test/ring",
+                    test_ring);
     g_test_add_func("/test/get_next_variable/all",
                     test_get_next_variable_all);
     g_test_add_func("/test/set_variable/attr",
@@ -2676,12 +3586,22 @@ int main(int argc, char **argv)
                     test_set_variable_update);
     g_test_add_func("/test/set_variable/append",
                     test_set_variable_append);
+    g_test_add_func("/test/set_variable/append_grow",
+                    test_set_variable_append_grow);
     g_test_add_func("/test/set_variable/delete",
                     test_set_variable_delete);
     g_test_add_func("/test/set_variable/resource_limit",
                     test_set_variable_resource_limit);
     g_test_add_func("/test/set_variable/many_vars",
                     test_set_variable_many_vars);
+    g_test_add_func("/test/set_variable/partitions",
+                    test_set_variable_partitions);
+    g_test_add_func("/test/set_variable/compact",
+                    test_set_variable_compact);
+    g_test_add_func("/test/set_variable/rollback",
+                    test_set_variable_rollback);
+    g_test_add_func("/test/set_variable/transaction",
+                    test_set_variable_transaction);
     g_test_add_func("/test/set_variable/non_volatile",
                     test_set_variable_non_volatile);
     g_test_add_func("/test/set_variable/special_vars",
@@ -2717,6 +3637,10 @@ int main(int argc, char **argv)
                     test_secure_set_dbx_usermode);
     g_test_add_func("/test/secure_set_variable/DBT/usermode",
                     test_secure_set_dbt_usermode);
+    g_test_add_func("/test/secure_set_variable/append_dedup",
+                    test_secure_append_dedup);
+    g_test_add_func("/test/secure_set_variable/replay",
+                    test_secure_set_replay);
 
     r = g_test_run();
     free_globals();
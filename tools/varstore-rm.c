@@ -41,6 +41,7 @@
 #include <depriv.h>
 #include <guid.h>
 #include <serialize.h>
+#include <varstore.h>
 
 #include "tool-lib.h"
 
@@ -180,16 +181,20 @@ out:
     return ret;
 }
 
-static void
+/* Removes all the variables in one transaction so they are saved once. */
+static bool
 do_rm_clone(void)
 {
     struct clone_variable *v = clone_vars;
 
+    varstore_begin();
     while (v) {
         printf("Removing: GUID: '%s' Name: '%s'\n", v->guid_str, v->name);
         do_rm(&v->guid, v->name);
         v = v->next;
     }
+
+    return varstore_commit(db->set_variable);
 }
 
 int main(int argc, char **argv)
@@ -230,15 +235,14 @@ int main(int argc, char **argv)
     if (clone_rm && !parse_clone_files())
         return 1;
 
-    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
+    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid, 0))
         exit(1);
 
     if (!tool_init())
         exit(1);
 
     if (clone_rm) {
-        do_rm_clone();
-        return 0;
+        return !do_rm_clone();
     } else {
         EFI_GUID guid;
 
@@ -41,6 +41,7 @@
 #include <depriv.h>
 #include <guid.h>
 #include <serialize.h>
+#include <varstore.h>
 
 #include "tool-lib.h"
 
@@ -61,6 +62,7 @@ usage(const char *progname)
 
 int main(int argc, char **argv)
 {
+    size_t mark;
     DEPRIV_VARS
 
     for (;;) {
@@ -95,12 +97,15 @@ int main(int argc, char **argv)
     if (!strcmp(argv[optind + 1], "user"))
         load_auth_data();
 
-    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
+    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid, 0))
         exit(1);
 
     if (!tool_init())
         exit(1);
 
+    /* Apply the whole reset atomically with a single save. */
+    mark = varstore_begin();
+
     /* Ignore errors in case the variables are missing. */
     printf("Removing PK...\n");
     do_rm(&gEfiGlobalVariableGuid, "PK");
@@ -111,8 +116,13 @@ int main(int argc, char **argv)
     printf("Removing dbx...\n");
     do_rm(&gEfiImageSecurityDatabaseGuid, "dbx");
 
-    if (!strcmp(argv[optind + 1], "user"))
-        return setup_keys();
-    else
-        return 0;
+    if (!strcmp(argv[optind + 1], "user")) {
+        if (!setup_keys()) {
+            varstore_abort(mark);
+            return 0;
+        }
+        return varstore_commit(db->set_variable);
+    } else {
+        return !varstore_commit(db->set_variable);
+    }
 }
@@ -166,7 +166,7 @@ int main(int argc, char **argv)
     if (opt_socket)
         db->parse_arg("socket", opt_socket);
 
-    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
+    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid, 0))
         exit(1);
 
     if (!tool_init())
@@ -0,0 +1,1047 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <efi.h>
+#include <guid.h>
+#include <handler.h>
+#include <slab.h>
+#include <varstore.h>
+
+/*
+ * Open addressing with linear probing. The table size is always a power of
+ * two and is kept at most half full so that probe sequences stay short.
+ */
+#define VARSTORE_MIN_SIZE 64
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static struct efi_variable **table;
+static size_t table_size;
+static size_t table_used;
+
+static struct efi_variable *part_head[VAR_PART_COUNT];
+static struct varstore_usage part_usage[VAR_PART_COUNT];
+
+/*
+ * Arrays of variables sorted by (GUID, name) which give GetNextVariable a
+ * stable enumeration order. There is one over all variables and one over
+ * the runtime accessible ones.
+ */
+struct var_order {
+    struct efi_variable **vars;
+    size_t len;
+    size_t cap;
+};
+
+static struct var_order order_all;
+static struct var_order order_runtime;
+
+/*
+ * Journal of the changes made by the open transaction, in order, holding
+ * what is needed to undo each of them. Replaced out of line data is
+ * detached rather than copied so that large variables are not duplicated;
+ * only inline data, bounded by VAR_INLINE_DATA, is saved by value.
+ */
+enum journal_op {
+    JOURNAL_INSERT,
+    JOURNAL_REMOVE,
+    JOURNAL_SET,
+    JOURNAL_APPEND,
+};
+
+struct journal_entry {
+    enum journal_op op;
+    struct efi_variable *var;
+    UINTN data_len;
+    EFI_TIME timestamp;
+    uint8_t cert[SHA256_DIGEST_SIZE];
+    uint8_t *data; /* Detached out of line data, if any */
+    size_t data_cap;
+    uint8_t inline_data[VAR_INLINE_DATA];
+};
+
+static struct journal_entry *journal;
+static size_t journal_len;
+static size_t journal_cap;
+static unsigned int txn_depth;
+
+static uint32_t
+fnv1a(uint32_t hash, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= buf[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+uint32_t
+varstore_hash(const uint8_t *name, UINTN name_len, const EFI_GUID *guid)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    hash = fnv1a(hash, (const uint8_t *)guid, GUID_LEN);
+    hash = fnv1a(hash, name, name_len);
+
+    return hash;
+}
+
+static void
+table_place(struct efi_variable **t, size_t size, struct efi_variable *var)
+{
+    size_t i = var->hash & (size - 1);
+
+    while (t[i])
+        i = (i + 1) & (size - 1);
+    t[i] = var;
+}
+
+/* Make room for one more entry, resizing the table if necessary. */
+static bool
+table_reserve(void)
+{
+    struct efi_variable **new_table;
+    size_t new_size, i;
+
+    if ((table_used + 1) * 2 <= table_size)
+        return true;
+
+    new_size = table_size ? table_size * 2 : VARSTORE_MIN_SIZE;
+    new_table = calloc(new_size, sizeof(*new_table));
+    if (!new_table)
+        return false;
+
+    for (i = 0; i < table_size; i++) {
+        if (table[i])
+            table_place(new_table, new_size, table[i]);
+    }
+
+    free(table);
+    table = new_table;
+    table_size = new_size;
+
+    return true;
+}
+
+/* Returns the slot holding var, or table_size if it is not indexed. */
+static size_t
+table_find(const struct efi_variable *var)
+{
+    size_t i;
+
+    if (!table_size)
+        return 0;
+
+    i = var->hash & (table_size - 1);
+    while (table[i]) {
+        if (table[i] == var)
+            return i;
+        i = (i + 1) & (table_size - 1);
+    }
+
+    return table_size;
+}
+
+struct efi_variable *
+varstore_lookup(const uint8_t *name, UINTN name_len, const EFI_GUID *guid)
+{
+    struct efi_variable *l;
+    uint32_t hash;
+    size_t i;
+
+    if (!table_size)
+        return NULL;
+
+    hash = varstore_hash(name, name_len, guid);
+    i = hash & (table_size - 1);
+    while ((l = table[i])) {
+        if (l->hash == hash &&
+                l->name_len == name_len &&
+                !memcmp(l->name, name, name_len) &&
+                !memcmp(&l->guid, guid, GUID_LEN))
+            return l;
+        i = (i + 1) & (table_size - 1);
+    }
+
+    return NULL;
+}
+
+static void
+list_link(struct efi_variable *var)
+{
+    if (var->prev)
+        var->prev->next = var;
+    else
+        var_list = var;
+    if (var->next)
+        var->next->prev = var;
+}
+
+static bool
+in_partition(const struct efi_variable *var, enum var_partition p)
+{
+    switch (p) {
+    case VAR_PART_NV:
+        return !!(var->attributes & EFI_VARIABLE_NON_VOLATILE);
+    case VAR_PART_VOLATILE:
+        return !(var->attributes & EFI_VARIABLE_NON_VOLATILE);
+    case VAR_PART_RUNTIME:
+        return !!(var->attributes & EFI_VARIABLE_RUNTIME_ACCESS);
+    default:
+        return false;
+    }
+}
+
+static uint64_t
+var_size(const struct efi_variable *var)
+{
+    return var->name_len + var->data_len + VARIABLE_SIZE_OVERHEAD;
+}
+
+/* Links var into its partitions using its saved part[] pointers. */
+static void
+part_link(struct efi_variable *var)
+{
+    struct var_link *link;
+    int p;
+
+    for (p = 0; p < VAR_PART_COUNT; p++) {
+        if (!in_partition(var, p))
+            continue;
+
+        link = &var->part[p];
+        if (link->prev)
+            link->prev->part[p].next = var;
+        else
+            part_head[p] = var;
+        if (link->next)
+            link->next->part[p].prev = var;
+
+        part_usage[p].bytes += var_size(var);
+        part_usage[p].count++;
+    }
+}
+
+/* Unlinks var from its partitions, leaving its own part[] pointers intact. */
+static void
+part_unlink(struct efi_variable *var)
+{
+    struct var_link *link;
+    int p;
+
+    for (p = 0; p < VAR_PART_COUNT; p++) {
+        if (!in_partition(var, p))
+            continue;
+
+        link = &var->part[p];
+        if (link->prev)
+            link->prev->part[p].next = link->next;
+        else
+            part_head[p] = link->next;
+        if (link->next)
+            link->next->part[p].prev = link->prev;
+
+        part_usage[p].bytes -= var_size(var);
+        part_usage[p].count--;
+    }
+}
+
+static int
+var_key_cmp(const struct efi_variable *a, const struct efi_variable *b)
+{
+    int ret;
+
+    ret = memcmp(&a->guid, &b->guid, GUID_LEN);
+    if (ret)
+        return ret;
+
+    ret = memcmp(a->name, b->name,
+                 a->name_len < b->name_len ? a->name_len : b->name_len);
+    if (ret)
+        return ret;
+
+    if (a->name_len != b->name_len)
+        return a->name_len < b->name_len ? -1 : 1;
+
+    return 0;
+}
+
+/*
+ * Returns the index of the first entry not ordered before var. *found is set
+ * if that entry has the same key as var.
+ */
+static size_t
+order_search(const struct var_order *order, const struct efi_variable *var,
+             bool *found)
+{
+    size_t lo = 0, hi = order->len, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (var_key_cmp(order->vars[mid], var) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *found = lo < order->len && !var_key_cmp(order->vars[lo], var);
+    return lo;
+}
+
+static bool
+order_reserve(struct var_order *order)
+{
+    struct efi_variable **new_vars;
+    size_t new_cap;
+
+    if (order->len < order->cap)
+        return true;
+
+    new_cap = order->cap ? order->cap * 2 : VARSTORE_MIN_SIZE;
+    new_vars = realloc(order->vars, new_cap * sizeof(*new_vars));
+    if (!new_vars)
+        return false;
+
+    order->vars = new_vars;
+    order->cap = new_cap;
+
+    return true;
+}
+
+/* The caller must have reserved room with order_reserve(). */
+static void
+order_add(struct var_order *order, struct efi_variable *var)
+{
+    size_t i;
+    bool found;
+
+    i = order_search(order, var, &found);
+    memmove(&order->vars[i + 1], &order->vars[i],
+            (order->len - i) * sizeof(*order->vars));
+    order->vars[i] = var;
+    order->len++;
+}
+
+static void
+order_del(struct var_order *order, struct efi_variable *var)
+{
+    size_t i;
+    bool found;
+
+    i = order_search(order, var, &found);
+    if (!found)
+        return;
+
+    order->len--;
+    memmove(&order->vars[i], &order->vars[i + 1],
+            (order->len - i) * sizeof(*order->vars));
+}
+
+static void
+order_swap(struct var_order *order, struct efi_variable *old,
+           struct efi_variable *new)
+{
+    size_t i;
+    bool found;
+
+    i = order_search(order, old, &found);
+    if (found)
+        order->vars[i] = new;
+}
+
+static bool
+is_runtime(const struct efi_variable *var)
+{
+    return !!(var->attributes & EFI_VARIABLE_RUNTIME_ACCESS);
+}
+
+static struct journal_entry *
+journal_add(enum journal_op op, struct efi_variable *var)
+{
+    struct journal_entry *e;
+
+    if (journal_len == journal_cap) {
+        size_t cap = journal_cap ? journal_cap * 2 : 8;
+
+        e = realloc(journal, cap * sizeof(*journal));
+        if (!e)
+            return NULL;
+        journal = e;
+        journal_cap = cap;
+    }
+
+    e = &journal[journal_len++];
+    e->op = op;
+    e->var = var;
+    e->data_len = var->data_len;
+    e->timestamp = var->timestamp;
+    memcpy(e->cert, var->cert, sizeof(e->cert));
+    e->data = NULL;
+    e->data_cap = 0;
+
+    return e;
+}
+
+/*
+ * Adds a new variable to the head of var_list. Fails if a variable with the
+ * same name and GUID already exists or if memory cannot be allocated.
+ */
+bool
+varstore_insert(struct efi_variable *var)
+{
+    int p;
+
+    if (varstore_lookup(var->name, var->name_len, &var->guid))
+        return false;
+    if (!table_reserve() || !order_reserve(&order_all))
+        return false;
+    if (is_runtime(var) && !order_reserve(&order_runtime))
+        return false;
+    if (txn_depth && !journal_add(JOURNAL_INSERT, var))
+        return false;
+
+    var->hash = varstore_hash(var->name, var->name_len, &var->guid);
+    table_place(table, table_size, var);
+    table_used++;
+
+    var->prev = NULL;
+    var->next = var_list;
+    list_link(var);
+
+    for (p = 0; p < VAR_PART_COUNT; p++) {
+        var->part[p].prev = NULL;
+        var->part[p].next = part_head[p];
+    }
+    part_link(var);
+
+    order_add(&order_all, var);
+    if (is_runtime(var))
+        order_add(&order_runtime, var);
+
+    return true;
+}
+
+/*
+ * Unlinks var from var_list and the index without freeing it. The variable's
+ * own prev and next pointers are left untouched so that it can be put back
+ * in the same position with relink_var().
+ */
+static void
+unlink_var(struct efi_variable *var, size_t i)
+{
+    size_t j, k;
+
+    /* Shift back any entries whose probe sequence passes through slot i. */
+    table[i] = NULL;
+    j = i;
+    for (;;) {
+        j = (j + 1) & (table_size - 1);
+        if (!table[j])
+            break;
+        k = table[j]->hash & (table_size - 1);
+        if ((j > i) ? (k <= i || k > j) : (k <= i && k > j)) {
+            table[i] = table[j];
+            table[j] = NULL;
+            i = j;
+        }
+    }
+    table_used--;
+
+    if (var->prev)
+        var->prev->next = var->next;
+    else
+        var_list = var->next;
+    if (var->next)
+        var->next->prev = var->prev;
+    part_unlink(var);
+
+    order_del(&order_all, var);
+    if (is_runtime(var))
+        order_del(&order_runtime, var);
+}
+
+/*
+ * Re-inserts a variable previously unlinked by unlink_var(). The store must
+ * be as it was just after the removal, which also guarantees that the slot
+ * freed by the removal is still available.
+ */
+static void
+relink_var(struct efi_variable *var)
+{
+    table_place(table, table_size, var);
+    table_used++;
+    list_link(var);
+    part_link(var);
+
+    order_add(&order_all, var);
+    if (is_runtime(var))
+        order_add(&order_runtime, var);
+}
+
+/*
+ * Unlinks var from var_list and the index. Outside a transaction the caller
+ * then owns var; inside one it is freed when the transaction commits. Fails
+ * only if the removal cannot be journaled.
+ */
+bool
+varstore_remove(struct efi_variable *var)
+{
+    size_t i;
+
+    i = table_find(var);
+    if (i == table_size)
+        return true;
+
+    if (txn_depth && !journal_add(JOURNAL_REMOVE, var))
+        return false;
+    unlink_var(var, i);
+
+    return true;
+}
+
+/*
+ * Swaps new in for old, keeping old's position in var_list and its
+ * partitions. Both must have the same attributes.
+ */
+void
+varstore_replace(struct efi_variable *old, struct efi_variable *new)
+{
+    size_t i;
+
+    i = table_find(old);
+    if (i == table_size)
+        return;
+
+    part_unlink(old);
+    new->hash = old->hash;
+    new->prev = old->prev;
+    new->next = old->next;
+    memcpy(new->part, old->part, sizeof(new->part));
+    table[i] = new;
+    list_link(new);
+    part_link(new);
+
+    order_swap(&order_all, old, new);
+    if (is_runtime(new))
+        order_swap(&order_runtime, old, new);
+}
+
+static void
+account_resize(struct efi_variable *var, UINTN data_len)
+{
+    int p;
+
+    for (p = 0; p < VAR_PART_COUNT; p++) {
+        if (!in_partition(var, p))
+            continue;
+        part_usage[p].bytes -= var->data_len;
+        part_usage[p].bytes += data_len;
+    }
+}
+
+static uint8_t *
+inline_data(const struct efi_variable *var)
+{
+    return (uint8_t *)(var + 1) + var->name_len;
+}
+
+static bool
+data_is_inline(const struct efi_variable *var)
+{
+    return var->data == inline_data(var);
+}
+
+static size_t
+inline_cap(const struct efi_variable *var)
+{
+    size_t cap = var->rec_cap - sizeof(*var) - var->name_len;
+
+    return cap < VAR_INLINE_DATA ? cap : VAR_INLINE_DATA;
+}
+
+/*
+ * Makes sure var has room for data_len bytes of data, moving it out of line
+ * if necessary. The existing data is kept if keep is set.
+ */
+static bool
+data_reserve(struct efi_variable *var, UINTN data_len, bool keep)
+{
+    uint8_t *new_data;
+    size_t cap;
+
+    if (data_len <= var->data_cap)
+        return true;
+
+    if (keep && !data_is_inline(var)) {
+        new_data = slab_realloc(var->data, var->data_cap, var->data_len,
+                                data_len, &cap);
+        if (!new_data)
+            return false;
+        var->data = new_data;
+        var->data_cap = cap;
+        return true;
+    }
+
+    new_data = slab_alloc(data_len, &cap);
+    if (!new_data)
+        return false;
+    if (keep)
+        memcpy(new_data, var->data, var->data_len);
+    if (!data_is_inline(var))
+        slab_free(var->data, var->data_cap);
+    var->data = new_data;
+    var->data_cap = cap;
+
+    return true;
+}
+
+static uint64_t next_generation;
+
+/*
+ * Allocates a new, unindexed variable holding copies of name and data. Other
+ * fields are zeroed apart from the generation.
+ */
+struct efi_variable *
+varstore_new(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+             const uint8_t *data, UINTN data_len)
+{
+    struct efi_variable *var;
+    size_t cap;
+
+    var = slab_alloc(sizeof(*var) + name_len +
+                     (data_len <= VAR_INLINE_DATA ? data_len : 0), &cap);
+    if (!var)
+        return NULL;
+
+    memset(var, 0, sizeof(*var));
+    var->rec_cap = cap;
+    var->name = (uint8_t *)(var + 1);
+    memcpy(var->name, name, name_len);
+    var->name_len = name_len;
+    memcpy(&var->guid, guid, GUID_LEN);
+    var->data = inline_data(var);
+    var->data_cap = inline_cap(var);
+
+    if (!data_reserve(var, data_len, false)) {
+        slab_free(var, var->rec_cap);
+        return NULL;
+    }
+    memcpy(var->data, data, data_len);
+    var->data_len = data_len;
+    var->generation = ++next_generation;
+
+    return var;
+}
+
+void
+varstore_free(struct efi_variable *var)
+{
+    if (!var)
+        return;
+
+    if (!data_is_inline(var))
+        slab_free(var->data, var->data_cap);
+    slab_free(var, var->rec_cap);
+}
+
+static void
+journal_undo(struct journal_entry *e)
+{
+    struct efi_variable *var = e->var;
+
+    switch (e->op) {
+    case JOURNAL_INSERT:
+        unlink_var(var, table_find(var));
+        varstore_free(var);
+        return;
+    case JOURNAL_REMOVE:
+        relink_var(var);
+        return;
+    case JOURNAL_SET:
+        if (!data_is_inline(var))
+            slab_free(var->data, var->data_cap);
+        if (e->data) {
+            var->data = e->data;
+            var->data_cap = e->data_cap;
+        } else {
+            var->data = inline_data(var);
+            var->data_cap = inline_cap(var);
+            memcpy(var->data, e->inline_data, e->data_len);
+        }
+        break;
+    case JOURNAL_APPEND:
+        break;
+    }
+
+    account_resize(var, e->data_len);
+    var->data_len = e->data_len;
+    var->generation = ++next_generation;
+    var->timestamp = e->timestamp;
+    memcpy(var->cert, e->cert, sizeof(var->cert));
+}
+
+/*
+ * Replaces the data of var with a copy of data. If var is in the store, the
+ * partition totals are updated to match.
+ */
+bool
+varstore_set_data(struct efi_variable *var, const uint8_t *data, UINTN data_len)
+{
+    struct journal_entry *e = NULL;
+    bool indexed = table_find(var) != table_size;
+
+    if (txn_depth && indexed) {
+        e = journal_add(JOURNAL_SET, var);
+        if (!e)
+            return false;
+
+        if (data_is_inline(var)) {
+            memcpy(e->inline_data, var->data, var->data_len);
+        } else {
+            e->data = var->data;
+            e->data_cap = var->data_cap;
+            var->data = inline_data(var);
+            var->data_cap = inline_cap(var);
+        }
+    }
+
+    if (!data_reserve(var, data_len, false)) {
+        if (e) {
+            journal_undo(e);
+            journal_len--;
+        }
+        return false;
+    }
+
+    memcpy(var->data, data, data_len);
+    if (indexed)
+        account_resize(var, data_len);
+    var->data_len = data_len;
+    var->generation = ++next_generation;
+
+    return true;
+}
+
+/*
+ * As varstore_set_data() but appends to the existing data. Inside a
+ * transaction only the old length is journaled.
+ */
+bool
+varstore_append_data(struct efi_variable *var, const uint8_t *data,
+                     UINTN data_len)
+{
+    bool indexed = table_find(var) != table_size;
+
+    if (txn_depth && indexed && !journal_add(JOURNAL_APPEND, var))
+        return false;
+
+    if (!data_reserve(var, var->data_len + data_len, true)) {
+        if (txn_depth && indexed)
+            journal_len--;
+        return false;
+    }
+
+    memcpy(var->data + var->data_len, data, data_len);
+    if (indexed)
+        account_resize(var, var->data_len + data_len);
+    var->data_len += data_len;
+    var->generation = ++next_generation;
+
+    return true;
+}
+
+/* Returns whether e changed a non-volatile variable. */
+static bool
+journal_nv_change(const struct journal_entry *e)
+{
+    const struct efi_variable *var = e->var;
+    const uint8_t *old;
+
+    if (!(var->attributes & EFI_VARIABLE_NON_VOLATILE))
+        return false;
+
+    switch (e->op) {
+    case JOURNAL_INSERT:
+    case JOURNAL_REMOVE:
+        return true;
+    default:
+        break;
+    }
+
+    if (var->data_len != e->data_len)
+        return true;
+    if (memcmp(&var->timestamp, &e->timestamp, sizeof(var->timestamp)))
+        return true;
+    if (memcmp(var->cert, e->cert, sizeof(var->cert)))
+        return true;
+    if (e->op == JOURNAL_APPEND)
+        return false;
+
+    old = e->data ? e->data : e->inline_data;
+    return memcmp(var->data, old, var->data_len) != 0;
+}
+
+/* Undoes journal entries back to mark, newest first. */
+static void
+journal_rollback(size_t mark)
+{
+    while (journal_len > mark)
+        journal_undo(&journal[--journal_len]);
+}
+
+/* Frees what the journal holds on to once its changes are final. */
+static void
+journal_release(void)
+{
+    size_t i;
+
+    for (i = 0; i < journal_len; i++) {
+        if (journal[i].op == JOURNAL_REMOVE)
+            varstore_free(journal[i].var);
+        else if (journal[i].data)
+            slab_free(journal[i].data, journal[i].data_cap);
+    }
+    journal_len = 0;
+}
+
+/*
+ * Opens a transaction. Until the matching varstore_commit(), every change
+ * made with varstore_insert(), varstore_remove(), varstore_set_data() and
+ * varstore_append_data() is journaled so that all of them can be undone
+ * together. Transactions nest: the returned mark lets varstore_abort() undo
+ * just the changes of an inner transaction, and only the outermost commit
+ * makes the changes final.
+ */
+size_t
+varstore_begin(void)
+{
+    txn_depth++;
+
+    return journal_len;
+}
+
+/*
+ * Closes a transaction. When the outermost transaction commits and it
+ * changed any non-volatile variable, flush is called once to save the
+ * store; if it fails every change in the transaction is undone and false is
+ * returned. flush may be NULL if there is nothing to save to.
+ */
+bool
+varstore_commit(bool (*flush)(void))
+{
+    size_t i;
+    bool dirty = false;
+
+    if (--txn_depth)
+        return true;
+
+    for (i = 0; i < journal_len && !dirty; i++)
+        dirty = journal_nv_change(&journal[i]);
+
+    if (dirty && flush && !flush()) {
+        journal_rollback(0);
+        return false;
+    }
+
+    journal_release();
+
+    return true;
+}
+
+/* Undoes the changes made since mark and closes the transaction. */
+void
+varstore_abort(size_t mark)
+{
+    journal_rollback(mark);
+    if (!--txn_depth)
+        journal_release();
+}
+
+/*
+ * Returns an unindexed record for var in a new chunk, or NULL on failure.
+ * Out of line data is handed over to it rather than copied, so var must then
+ * be released with slab_free() alone.
+ */
+static struct efi_variable *
+move_record(const struct efi_variable *var)
+{
+    struct efi_variable *new;
+    size_t cap;
+
+    /* The same capacity keeps the inline data capacity too. */
+    new = slab_alloc(var->rec_cap, &cap);
+    if (!new)
+        return NULL;
+
+    memset(new, 0, sizeof(*new));
+    new->rec_cap = cap;
+    new->name = (uint8_t *)(new + 1);
+    memcpy(new->name, var->name, var->name_len);
+    new->name_len = var->name_len;
+    memcpy(&new->guid, &var->guid, GUID_LEN);
+    new->attributes = var->attributes;
+    new->timestamp = var->timestamp;
+    memcpy(new->cert, var->cert, sizeof(new->cert));
+    new->hash = var->hash;
+    new->generation = var->generation;
+
+    if (data_is_inline(var)) {
+        new->data = inline_data(new);
+        new->data_cap = inline_cap(new);
+        memcpy(new->data, var->data, var->data_len);
+    } else {
+        new->data = var->data;
+        new->data_cap = var->data_cap;
+    }
+    new->data_len = var->data_len;
+
+    return new;
+}
+
+/*
+ * Moves variables out of sparsely used slabs so that the slabs can be given
+ * back. Must only be called between requests since records may move.
+ */
+void
+varstore_compact(void)
+{
+    struct efi_variable *l, *next, *new;
+    uint8_t *new_data;
+    size_t cap;
+
+    /* The journal refers to records by address. */
+    if (txn_depth || !slab_compact_begin())
+        return;
+
+    for (l = var_list; l; l = next) {
+        next = l->next;
+
+        if (!data_is_inline(l) && slab_draining(l->data, l->data_cap)) {
+            /* Keep the headroom for appends. */
+            new_data = slab_alloc(l->data_cap, &cap);
+            if (new_data) {
+                memcpy(new_data, l->data, l->data_len);
+                slab_free(l->data, l->data_cap);
+                l->data = new_data;
+                l->data_cap = cap;
+            }
+        }
+
+        if (slab_draining(l, l->rec_cap)) {
+            new = move_record(l);
+            if (new) {
+                varstore_replace(l, new);
+                slab_free(l, l->rec_cap);
+            }
+        }
+    }
+
+    slab_compact_end();
+}
+
+/*
+ * Returns the variable ordered immediately after var by (GUID, name), or the
+ * first variable if var is NULL. var need not be in the store.
+ */
+struct efi_variable *
+varstore_next(const struct efi_variable *var, bool runtime_only)
+{
+    const struct var_order *order = runtime_only ? &order_runtime : &order_all;
+    size_t i = 0;
+    bool found;
+
+    if (var) {
+        i = order_search(order, var, &found);
+        if (found)
+            i++;
+    }
+
+    return i < order->len ? order->vars[i] : NULL;
+}
+
+struct efi_variable *
+varstore_first(enum var_partition p)
+{
+    return part_head[p];
+}
+
+const struct varstore_usage *
+varstore_usage(enum var_partition p)
+{
+    return &part_usage[p];
+}
+
+/* Space used by all variables, counted against TOTAL_LIMIT. */
+uint64_t
+varstore_total_usage(void)
+{
+    return part_usage[VAR_PART_NV].bytes + part_usage[VAR_PART_VOLATILE].bytes;
+}
+
+/* Frees every variable and the index. */
+void
+varstore_clear(void)
+{
+    struct efi_variable *l, *next;
+
+    journal_release();
+    l = var_list;
+    while (l) {
+        next = l->next;
+        varstore_free(l);
+        l = next;
+    }
+    var_list = NULL;
+    memset(part_head, 0, sizeof(part_head));
+    memset(part_usage, 0, sizeof(part_usage));
+
+    free(order_all.vars);
+    memset(&order_all, 0, sizeof(order_all));
+    free(order_runtime.vars);
+    memset(&order_runtime, 0, sizeof(order_runtime));
+
+    free(table);
+    table = NULL;
+    table_size = 0;
+    table_used = 0;
+
+    free(journal);
+    journal = NULL;
+    journal_len = 0;
+    journal_cap = 0;
+    txn_depth = 0;
+}
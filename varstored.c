@@ -31,6 +31,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdint.h>
@@ -42,6 +43,8 @@
 #include <unistd.h>
 #include <assert.h>
 
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/select.h>
@@ -65,9 +68,11 @@
 
 #include <debug.h>
 #include <depriv.h>
+#include <event.h>
 #include <handler_port.h>
 #include <mor.h>
 #include <ppi.h>
+#include <ring_port.h>
 #include <backend.h>
 
 #include "io_port.h"
@@ -80,6 +85,17 @@
 #endif
 
 #define IO_PORT_ADDRESS 0x0100
+
+/*
+ * With --spin, the event channel is polled for a while after each request
+ * before going back to sleep. The window adapts between SPIN_MIN_NS and the
+ * given maximum, and spinning is capped at SPIN_BUDGET_NS of CPU time in
+ * each SPIN_PERIOD_NS.
+ */
+#define SPIN_MIN_NS 1000ull
+#define SPIN_PERIOD_NS 1000000000ull
+#define SPIN_BUDGET_NS (SPIN_PERIOD_NS / 20)
+
 #define XS_VARSTORED_PID_PATH "/local/domain/%u/varstored-pid"
 
 enum {
@@ -93,6 +109,10 @@ enum {
     VARSTORED_OPT_PIDFILE,
     VARSTORED_OPT_BACKEND,
     VARSTORED_OPT_ARG,
+    VARSTORED_OPT_THREADS,
+    VARSTORED_OPT_SPIN,
+    VARSTORED_OPT_STATS,
+    VARSTORED_OPT_RING,
     VARSTORED_NR_OPTS
     };
 
@@ -107,6 +127,10 @@ static struct option varstored_option[] = {
     {"pidfile", 1, NULL, 0},
     {"backend", 1, NULL, 0},
     {"arg", 1, NULL, 0},
+    {"threads", 0, NULL, 0},
+    {"spin", 1, NULL, 0},
+    {"stats", 1, NULL, 0},
+    {"ring", 0, NULL, 0},
     {NULL, 0, NULL, 0}
 };
 
@@ -121,6 +145,10 @@ static const char *varstored_option_text[] = {
     "<pidfile>",
     "<backend>",
     "<name>:<val>",
+    NULL,
+    "<usecs>",
+    "<secs>",
+    NULL,
 };
 
 const size_t num_io_port = 3;
@@ -131,6 +159,10 @@ static const char *prog;
 const struct backend *db;
 bool opt_resume;
 static bool opt_depriv;
+static bool opt_threads;
+static uint64_t opt_spin_ns;
+static unsigned int opt_stats_secs;
+static bool opt_ring;
 static uid_t opt_uid;
 static gid_t opt_gid;
 static char *opt_chroot;
@@ -158,6 +190,24 @@ usage(void)
     exit(2);
 }
 
+/*
+ * With --threads, each vCPU's event channel is bound on its own handle and
+ * served by its own worker thread. Otherwise all share varstored_state.evth
+ * and are served by the main loop.
+ */
+struct varstored_vcpu {
+    xenevtchn_handle *evth;
+    xenevtchn_port_or_error_t port;
+    pthread_t thread;
+    bool running;
+};
+
+struct spin_state {
+    uint64_t window_ns;
+    uint64_t period_start;
+    uint64_t spent_ns; /* Spinning done in the current period */
+};
+
 typedef struct varstored_state {
     xendevicemodel_handle *dmod;
     xenforeignmemory_handle *fmem;
@@ -168,7 +218,12 @@ typedef struct varstored_state {
     bool ioserv_created;
     xenforeignmemory_resource_handle *iores;
     shared_iopage_t *iopage;
-    xenevtchn_port_or_error_t *ioreq_local_port;
+    struct varstored_vcpu *vcpu;
+    int *port_vcpu; /* vCPU bound to each local port, or -1 */
+    xenevtchn_port_or_error_t max_port;
+    int stop_fd; /* Becomes readable when workers should exit */
+    int sig_fd;
+    struct spin_state *spin;
 } varstored_state_t;
 
 static varstored_state_t varstored_state;
@@ -292,6 +347,8 @@ handle_ioreq(ioreq_t *ioreq)
         break;
 
     case IOREQ_TYPE_INVALIDATE:
+        /* The guest's memory changed, so cached mappings may be stale. */
+        invalidate_handler_io_port();
         break;
 
     default:
@@ -300,21 +357,56 @@ handle_ioreq(ioreq_t *ioreq)
     }
 }
 
+static void
+varstored_stop_workers(void)
+{
+    uint64_t one = 1;
+    int i;
+
+    if (varstored_state.stop_fd < 0)
+        return;
+
+    if (write(varstored_state.stop_fd, &one, sizeof(one)) != sizeof(one))
+        ERR("Failed to stop workers: %d, %s\n", errno, strerror(errno));
+
+    for (i = 0; i < varstored_state.vcpus; i++) {
+        if (varstored_state.vcpu[i].running) {
+            pthread_join(varstored_state.vcpu[i].thread, NULL);
+            varstored_state.vcpu[i].running = false;
+        }
+    }
+
+    close(varstored_state.stop_fd);
+    varstored_state.stop_fd = -1;
+}
+
 static void
 varstored_teardown(void)
 {
+    struct varstored_vcpu *vcpu;
     int i;
 
+    varstored_stop_workers();
+    teardown_ring_port();
+    flush_ppi_variables();
+    teardown_handler_io_port();
     io_port_deregister();
 
-    if (varstored_state.ioreq_local_port) {
+    if (varstored_state.vcpu) {
         for (i = 0; i < varstored_state.vcpus; i++) {
-            if (varstored_state.ioreq_local_port[i])
-                xenevtchn_unbind(varstored_state.evth,
-                                 varstored_state.ioreq_local_port[i]);
+            vcpu = &varstored_state.vcpu[i];
+            if (vcpu->port)
+                xenevtchn_unbind(vcpu->evth, vcpu->port);
+            if (vcpu->evth != varstored_state.evth)
+                xenevtchn_close(vcpu->evth);
         }
-        free(varstored_state.ioreq_local_port);
+        free(varstored_state.vcpu);
     }
+    free(varstored_state.port_vcpu);
+
+    event_destroy();
+    if (varstored_state.sig_fd >= 0)
+        close(varstored_state.sig_fd);
 
     if (varstored_state.ioserv_created)
         xendevicemodel_set_ioreq_server_state(varstored_state.dmod,
@@ -345,6 +437,32 @@ varstored_signal(int num)
         _exit(0);
 }
 
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Lets pending ports be drained without blocking once none are left. */
+static bool
+set_nonblocking(xenevtchn_handle *evth)
+{
+    int fd = xenevtchn_fd(evth);
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ERR("Failed to make evtchn handle non-blocking: %d, %s\n",
+            errno, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 static bool
 varstored_initialize(domid_t domid)
 {
@@ -353,6 +471,8 @@ varstored_initialize(domid_t domid)
     void *addr = NULL;
 
     varstored_state.domid = domid;
+    varstored_state.stop_fd = -1;
+    varstored_state.sig_fd = -1;
 
     varstored_state.dmod = xendevicemodel_open(NULL, 0);
     if (!varstored_state.dmod) {
@@ -375,12 +495,6 @@ varstored_initialize(domid_t domid)
         goto err;
     }
 
-    rc = xentoolcore_restrict_all(domid);
-    if (rc < 0) {
-        ERR("Failed to restrict Xen handles: %d, %s\n", errno, strerror(errno));
-        goto err;
-    }
-
     rc = xendevicemodel_nr_vcpus(varstored_state.dmod, varstored_state.domid,
                                  &varstored_state.vcpus);
     if (rc < 0) {
@@ -390,6 +504,42 @@ varstored_initialize(domid_t domid)
 
     INFO("%d vCPU(s)\n", varstored_state.vcpus);
 
+    varstored_state.vcpu = calloc(varstored_state.vcpus,
+                                  sizeof(*varstored_state.vcpu));
+    if (!varstored_state.vcpu) {
+        ERR("Failed to alloc vCPU array: %d, %s\n", errno, strerror(errno));
+        goto err;
+    }
+
+    if (!set_nonblocking(varstored_state.evth))
+        goto err;
+
+    /* Every handle must be open before they are restricted. */
+    for (i = 0; i < varstored_state.vcpus; i++) {
+        if (!opt_threads) {
+            varstored_state.vcpu[i].evth = varstored_state.evth;
+            continue;
+        }
+
+        varstored_state.vcpu[i].evth = xenevtchn_open(NULL, 0);
+        if (!varstored_state.vcpu[i].evth) {
+            ERR("Failed to open evtchn handle: %d, %s\n",
+                errno, strerror(errno));
+            goto err;
+        }
+        if (!set_nonblocking(varstored_state.vcpu[i].evth))
+            goto err;
+    }
+
+    if (opt_ring && !setup_ring_port(domid, varstored_state.fmem))
+        goto err;
+
+    rc = xentoolcore_restrict_all(domid);
+    if (rc < 0) {
+        ERR("Failed to restrict Xen handles: %d, %s\n", errno, strerror(errno));
+        goto err;
+    }
+
     rc = xendevicemodel_create_ioreq_server(varstored_state.dmod,
                                             varstored_state.domid, 0,
                                             &varstored_state.ioservid);
@@ -427,27 +577,34 @@ varstored_initialize(domid_t domid)
         goto err;
     }
 
-    varstored_state.ioreq_local_port = calloc(sizeof(xenevtchn_port_or_error_t),
-                                              varstored_state.vcpus);
-    if (!varstored_state.ioreq_local_port) {
-        ERR("Failed to alloc port array: %d, %s\n", errno, strerror(errno));
-        goto err;
-    }
-
     for (i = 0; i < varstored_state.vcpus; i++) {
-        rc = xenevtchn_bind_interdomain(varstored_state.evth, varstored_state.domid,
+        rc = xenevtchn_bind_interdomain(varstored_state.vcpu[i].evth,
+                                        varstored_state.domid,
                                         varstored_state.iopage->vcpu_ioreq[i].vp_eport);
         if (rc < 0) {
             ERR("Failed to bind port: %d, %s\n", errno, strerror(errno));
             goto err;
         }
-        varstored_state.ioreq_local_port[i] = rc;
+        varstored_state.vcpu[i].port = rc;
+        if (rc > varstored_state.max_port)
+            varstored_state.max_port = rc;
     }
 
+    varstored_state.port_vcpu = malloc((varstored_state.max_port + 1) *
+                                       sizeof(*varstored_state.port_vcpu));
+    if (!varstored_state.port_vcpu) {
+        ERR("Failed to alloc port map: %d, %s\n", errno, strerror(errno));
+        goto err;
+    }
+    for (i = 0; i <= varstored_state.max_port; i++)
+        varstored_state.port_vcpu[i] = -1;
+    for (i = 0; i < varstored_state.vcpus; i++)
+        varstored_state.port_vcpu[varstored_state.vcpu[i].port] = i;
+
     for (i = 0; i < varstored_state.vcpus; i++)
         INFO("VCPU%d: %u -> %u\n", i,
             varstored_state.iopage->vcpu_ioreq[i].vp_eport,
-            varstored_state.ioreq_local_port[i]);
+            varstored_state.vcpu[i].port);
 
     rc = io_port_initialize(varstored_state.dmod, varstored_state.domid,
                             varstored_state.ioservid,
@@ -486,7 +643,8 @@ varstored_initialize(domid_t domid)
     xs_close(xsh);
     xsh = NULL;
 
-    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
+    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid,
+                         opt_threads ? varstored_state.vcpus : 0))
         goto err;
 
     /* Guest data should not be accessed before this point. */
@@ -561,25 +719,213 @@ varstored_poll_iopage(unsigned int i)
     ioreq->state = STATE_IORESP_READY;
     smp_mb();
 
-    xenevtchn_notify(varstored_state.evth, varstored_state.ioreq_local_port[i]);
+    xenevtchn_notify(varstored_state.vcpu[i].evth, varstored_state.vcpu[i].port);
 }
 
-static void
-varstored_poll_iopages(void)
+/*
+ * Handles every port pending on evth and returns how many requests were
+ * served. The handle is non-blocking so this stops once it has been drained.
+ */
+static unsigned int
+varstored_poll_iopages(xenevtchn_handle *evth)
 {
     xenevtchn_port_or_error_t port;
+    unsigned int n = 0;
     int i;
 
-    port = xenevtchn_pending(varstored_state.evth);
-    if (port < 0)
+    while ((port = xenevtchn_pending(evth)) >= 0) {
+        if (port > varstored_state.max_port)
+            continue;
+        i = varstored_state.port_vcpu[port];
+        if (i < 0)
+            continue;
+
+        xenevtchn_unmask(evth, port);
+        varstored_poll_iopage(i);
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Firmware issues variable services calls in bursts, e.g. when enumerating
+ * variables at boot, so after serving a request keep polling for a short
+ * window rather than sleeping straight away. The window doubles each time
+ * spinning finds more work and halves when it does not. A guest that makes
+ * no requests never causes any spinning.
+ */
+static void
+varstored_spin(xenevtchn_handle *evth, struct spin_state *spin)
+{
+    uint64_t start, now, end, limit;
+    bool found = false;
+
+    if (!opt_spin_ns)
+        return;
+
+    start = now_ns();
+    if (start - spin->period_start >= SPIN_PERIOD_NS) {
+        spin->period_start = start;
+        spin->spent_ns = 0;
+    }
+    if (spin->spent_ns >= SPIN_BUDGET_NS)
         return;
+    if (spin->window_ns < SPIN_MIN_NS)
+        spin->window_ns = SPIN_MIN_NS;
+
+    limit = start + SPIN_BUDGET_NS - spin->spent_ns;
+    end = start + spin->window_ns;
+    for (now = start; now < end && run_main_loop; now = now_ns()) {
+        if (varstored_poll_iopages(evth)) {
+            found = true;
+            end = now + spin->window_ns;
+        }
+        if (end > limit)
+            end = limit;
+    }
+
+    spin->spent_ns += now - start;
+    if (found)
+        spin->window_ns = spin->window_ns * 2 < opt_spin_ns ?
+                          spin->window_ns * 2 : opt_spin_ns;
+    else
+        spin->window_ns /= 2;
+}
+
+static void *
+varstored_worker(void *arg)
+{
+    struct varstored_vcpu *vcpu = arg;
+    struct spin_state spin = {0};
+    struct pollfd pfd[2];
+    int rc;
+
+    pfd[0].fd = xenevtchn_fd(vcpu->evth);
+    pfd[0].events = POLLIN | POLLERR | POLLHUP;
+    pfd[1].fd = varstored_state.stop_fd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        rc = poll(pfd, ARRAY_SIZE(pfd), -1);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("poll failed: %d, %s\n", errno, strerror(errno));
+            /* Have the main thread shut everything down. */
+            kill(getpid(), SIGTERM);
+            break;
+        }
+
+        if (pfd[1].revents & POLLIN)
+            break;
+
+        if ((pfd[0].revents & POLLIN) && varstored_poll_iopages(vcpu->evth))
+            varstored_spin(vcpu->evth, &spin);
+    }
+
+    release_handler_io_port();
+    free_request_arena();
+    return NULL;
+}
+
+/*
+ * Serves each vCPU from its own thread. They inherit the main thread's signal
+ * mask, so signals are only ever seen by the main loop.
+ */
+static bool
+varstored_start_workers(void)
+{
+    int i, rc;
+
+    varstored_state.stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (varstored_state.stop_fd < 0) {
+        ERR("Failed to create eventfd: %d, %s\n", errno, strerror(errno));
+        return false;
+    }
 
     for (i = 0; i < varstored_state.vcpus; i++) {
-        if (port == varstored_state.ioreq_local_port[i]) {
-            xenevtchn_unmask(varstored_state.evth, port);
-            varstored_poll_iopage(i);
+        rc = pthread_create(&varstored_state.vcpu[i].thread, NULL,
+                            varstored_worker, &varstored_state.vcpu[i]);
+        if (rc) {
+            ERR("Failed to create worker: %d, %s\n", rc, strerror(rc));
+            return false;
         }
+        varstored_state.vcpu[i].running = true;
     }
+
+    return true;
+}
+
+static void
+varstored_evtchn_ready(void *opaque)
+{
+    if (varstored_poll_iopages(varstored_state.evth))
+        varstored_spin(varstored_state.evth, varstored_state.spin);
+}
+
+static void
+varstored_signal_ready(void *opaque)
+{
+    struct signalfd_siginfo info;
+
+    while (read(varstored_state.sig_fd, &info, sizeof(info)) == sizeof(info)) {
+        INFO("Received signal %u\n", info.ssi_signo);
+        run_main_loop = 0;
+    }
+}
+
+static void
+varstored_log_stats(void *opaque)
+{
+    log_handler_port_stats();
+}
+
+/*
+ * Everything other than vCPU requests in threaded mode is driven from one
+ * epoll loop: the event channel, signals through a signalfd, and any timers
+ * or backend descriptors registered with event_add_*().
+ */
+static bool
+varstored_setup_loop(sigset_t *blocked)
+{
+    sigset_t set;
+
+    if (!event_init())
+        return false;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    sigprocmask(SIG_BLOCK, &set, blocked);
+
+    varstored_state.sig_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (varstored_state.sig_fd < 0) {
+        ERR("Failed to create signalfd: %d, %s\n", errno, strerror(errno));
+        return false;
+    }
+    if (!event_add_fd(varstored_state.sig_fd, varstored_signal_ready, NULL))
+        return false;
+
+    if (!setup_ppi_flush())
+        return false;
+
+    if (!opt_threads &&
+        !event_add_fd(xenevtchn_fd(varstored_state.evth),
+                      varstored_evtchn_ready, NULL))
+        return false;
+
+    if (opt_ring && !event_add_fd(ring_port_fd(), ring_port_ready, NULL))
+        return false;
+
+    if (opt_stats_secs &&
+        !event_add_timer(opt_stats_secs * 1000, true,
+                         varstored_log_stats, NULL))
+        return false;
+
+    return true;
 }
 
 int
@@ -591,8 +937,8 @@ main(int argc, char **argv)
     int             index;
     char            *end;
     domid_t         domid;
-    struct pollfd   pfd;
-    int             rc;
+    struct spin_state spin = {0};
+    sigset_t        blocked;
 
     prog = basename(argv[0]);
 
@@ -664,6 +1010,30 @@ main(int argc, char **argv)
             }
             break;
 
+        case VARSTORED_OPT_THREADS:
+            opt_threads = true;
+            break;
+
+        case VARSTORED_OPT_RING:
+            opt_ring = true;
+            break;
+
+        case VARSTORED_OPT_STATS:
+            opt_stats_secs = (unsigned int)strtoul(optarg, &end, 0);
+            if (*end != '\0') {
+                fprintf(stderr, "invalid stats interval '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case VARSTORED_OPT_SPIN:
+            opt_spin_ns = strtoull(optarg, &end, 0) * 1000;
+            if (*end != '\0') {
+                fprintf(stderr, "invalid spin time '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+
         case VARSTORED_OPT_ARG:
             if (!db) {
                 fprintf(stderr, "Must set backend before backend args\n");
@@ -716,24 +1086,21 @@ main(int argc, char **argv)
         exit(1);
     }
 
-    pfd.fd = xenevtchn_fd(varstored_state.evth);
-    pfd.events = POLLIN | POLLERR | POLLHUP;
-    pfd.revents = 0;
-
+    varstored_state.spin = &spin;
     run_main_loop = 1;
-    while (run_main_loop) {
-        rc = poll(&pfd, 1, -1);
-
-        if (!run_main_loop)
-            break;
-
-        if (rc > 0 && pfd.revents & POLLIN)
-            varstored_poll_iopages();
+    if (!varstored_setup_loop(&blocked) ||
+        (opt_threads && !varstored_start_workers()))
+        run_main_loop = 0;
 
-        if (rc < 0 && errno != EINTR)
+    while (run_main_loop) {
+        if (!event_dispatch(-1))
             break;
     }
 
+    /* A second signal while shutting down exits straight away. */
+    run_main_loop = 0;
+    sigprocmask(SIG_SETMASK, &blocked, NULL);
+
     varstored_teardown();
 
     if (!db->save())
@@ -50,6 +50,7 @@
 #include <mor.h>
 #include <ppi.h>
 #include <serialize.h>
+#include <varstore.h>
 #include <xapidb.h>
 
 #define MAX_HTTP_SIZE (256 * 1024)
@@ -162,25 +163,26 @@ bool
 xapidb_serialize_variables(uint8_t **out, size_t *out_len, bool only_nv)
 {
     struct efi_variable *l;
+    const struct varstore_usage *usage;
     uint8_t *buf, *ptr;
-    size_t data_len = 0, count = 0;
+    size_t data_len, count;
 
-    l = var_list;
-    while (l) {
-        if (only_nv && !(l->attributes & EFI_VARIABLE_NON_VOLATILE)) {
-            l = l->next;
-            continue;
-        }
-
-        data_len += sizeof(l->name_len) + l->name_len;
-        data_len += sizeof(l->data_len) + l->data_len;
-        data_len += GUID_LEN;
-        data_len += sizeof(l->attributes);
-        data_len += sizeof(l->timestamp);
-        data_len += sizeof(l->cert);
-        count++;
-        l = l->next;
-    }
+    /*
+     * The partition totals already hold the name and data sizes so the
+     * buffer size can be computed without walking the variables.
+     */
+    usage = varstore_usage(VAR_PART_NV);
+    data_len = usage->bytes;
+    count = usage->count;
+    if (!only_nv) {
+        usage = varstore_usage(VAR_PART_VOLATILE);
+        data_len += usage->bytes;
+        count += usage->count;
+    }
+    data_len -= count * VARIABLE_SIZE_OVERHEAD;
+    data_len += count * (sizeof(l->name_len) + sizeof(l->data_len) +
+                         GUID_LEN + sizeof(l->attributes) +
+                         sizeof(l->timestamp) + sizeof(l->cert));
     assert(ANCILLARY_DATA_LEN == sizeof(mor_key) + sizeof(ppi_vdata));
 
     buf = malloc(data_len + DB_HEADER_LEN + ANCILLARY_DATA_LEN);
@@ -190,7 +192,7 @@ xapidb_serialize_variables(uint8_t **out, size_t *out_len, bool only_nv)
     }
 
     ptr = buf;
-    l = var_list;
+    l = only_nv ? varstore_first(VAR_PART_NV) : var_list;
 
     memcpy(ptr, DB_MAGIC, strlen(DB_MAGIC));
     ptr += strlen(DB_MAGIC);
@@ -206,11 +208,6 @@ xapidb_serialize_variables(uint8_t **out, size_t *out_len, bool only_nv)
     ptr += sizeof(ppi_vdata);
 
     while (l) {
-        if (only_nv && !(l->attributes & EFI_VARIABLE_NON_VOLATILE)) {
-            l = l->next;
-            continue;
-        }
-
         serialize_data(&ptr, l->name, l->name_len);
         serialize_data(&ptr, l->data, l->data_len);
         serialize_guid(&ptr, &l->guid);
@@ -218,7 +215,7 @@ xapidb_serialize_variables(uint8_t **out, size_t *out_len, bool only_nv)
         serialize_timestamp(&ptr, &l->timestamp);
         memcpy(ptr, l->cert, sizeof(l->cert));
         ptr += sizeof(l->cert);
-        l = l->next;
+        l = only_nv ? l->part[VAR_PART_NV].next : l->next;
     }
 
     *out = buf;
@@ -535,40 +532,50 @@ unserialize_variables(uint8_t **buf, size_t count, size_t rem)
 #define VARIABLE_SIZE \
     (sizeof(l->name_len) + sizeof(l->data_len) + sizeof(l->guid) + \
      sizeof(l->attributes) + sizeof(l->timestamp) + sizeof(l->cert))
-    struct efi_variable *l;
+    struct efi_variable *l = NULL;
+    uint8_t *name = NULL, *data = NULL;
+    UINTN name_len, data_len;
+    EFI_GUID guid;
     size_t i;
 
     for (i = 0; i < count; i++) {
-        l = calloc(1, sizeof(*l));
-        if (!l) {
-            ERR("Failed to allocate memory\n");
-            return false;
-        }
-
         if (rem < VARIABLE_SIZE)
             goto invalid;
         rem -= VARIABLE_SIZE;
 
-        l->name = unserialize_data(buf, &l->name_len,
-                                   rem < NAME_LIMIT ? rem : NAME_LIMIT);
-        if (!l->name)
+        name = unserialize_data(buf, &name_len,
+                                rem < NAME_LIMIT ? rem : NAME_LIMIT);
+        if (!name)
             goto invalid;
-        rem -= l->name_len;
+        rem -= name_len;
 
-        l->data = unserialize_data(buf, &l->data_len,
-                                   rem < DATA_LIMIT ? rem : DATA_LIMIT);
-        if (!l->data)
+        data = unserialize_data(buf, &data_len,
+                                rem < DATA_LIMIT ? rem : DATA_LIMIT);
+        if (!data)
             goto invalid;
-        rem -= l->data_len;
+        rem -= data_len;
+
+        unserialize_guid(buf, &guid);
+
+        l = varstore_new(name, name_len, &guid, data, data_len);
+        if (!l) {
+            ERR("Failed to allocate memory\n");
+            goto invalid;
+        }
+        free(name);
+        free(data);
+        name = data = NULL;
 
-        unserialize_guid(buf, &l->guid);
         l->attributes = unserialize_uint32(buf);
         unserialize_timestamp(buf, &l->timestamp);
         memcpy(l->cert, *buf, sizeof(l->cert));
         *buf += sizeof(l->cert);
 
-        l->next = var_list;
-        var_list = l;
+        if (!varstore_insert(l)) {
+            ERR("Duplicate variable or out of memory\n");
+            goto invalid;
+        }
+        l = NULL;
     }
 
     if (rem) {
@@ -580,9 +587,9 @@ unserialize_variables(uint8_t **buf, size_t count, size_t rem)
 
 invalid:
     ERR("Failed to unserialize variable!\n");
-    free(l->name);
-    free(l->data);
-    free(l);
+    varstore_free(l);
+    free(name);
+    free(data);
 
     return false;
 #undef VARIABLE_SIZE